@@ -25,30 +25,42 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #include <string.h>
 #include <ctype.h>
 
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
 #ifdef DEBUG
 #define dbg printf
 #else
 void dbg (char *fmt, ...) { }
 #endif
 
-#define DEBUG_GC_BEFORE_ALLOC 1
-
 /* Data types and representation.
  
    Suo knows about the following kinds of values: small integers,
-   characters, booleans, vectors, byte vectors, records, pairs, code
+   characters, symbols, booleans, vectors, byte vectors, records, pairs, code
    blocks, the empty list, and the 'unspecified' value.
 
    A small integer is an integer between -536870912 and 536870911,
-   inclusive.
+   inclusive, or between -2305843009213693952 and 2305843009213693951
+   in the 64bit version.  Larger integers are records, see 'Big
+   integers'.
 
    A character is a Unicode code point between 0 and 16777217,
    inclusive.
 
+   A symbol is a name that is only stored once, so that two symbols
+   with the same name are the same value.
+
    A boolean is either the 'true' value, or the 'false' value.
 
    A vector can store an arbitrary number of values in contigous
@@ -78,10 +90,21 @@ void dbg (char *fmt, ...) { }
    linked list; and the 'unspecified value', which is used to
    initialize fresh storage locations.
 
+   When compiled with VAL_NAN, Suo also knows about double precision
+   floating point numbers, see 'Floating point numbers'.
+
    All of these values are represented as 32 bit words.  Some of them
    can be stored completely in 32 bits (like characters), and some of
    them are pointers into a big heap of more words (like vectors).
 
+   When Suo is compiled with VAL_64, it is the 64bit version and all
+   values are 64 bit words instead.  Nothing else changes: the tags
+   and headers are exactly the same, there are just more bits left
+   for the rest.
+
+   When it is compiled with VAL_COMPRESSED on a 64 bit host, values
+   stay 32 bit words, but pointers are stored 'compressed', see below.
+
    What kind of value a word represent can be determined by looking at
    some of its lower bits.  These bits are called the 'tag' of a word.
    With three bits we get 8 different tags, and we use them like this:
@@ -93,7 +116,8 @@ void dbg (char *fmt, ...) { }
    011 - records
    101 - byte vectors and code blocks
    110 - record descriptors
-   111 - characters, booleans, empty list, unspecified, headers
+   111 - characters, symbols, booleans, empty list, unspecified,
+         headers
 
    (The significance of record descriptors and headers will be
    explained later.  Just ignore them for now.)
@@ -104,7 +128,8 @@ void dbg (char *fmt, ...) { }
 
    For values that contain a pointer into the heap, 29 bits allow us
    to point to 512M words.  (If you need more, you need the 64bit
-   version of Suo.) 
+   version of Suo, where small integers have 62 bits and pointers can
+   point anywhere.)
 
    To keep things straightforward and efficient, we just zero out the
    tag bits when converting a value to the heap pointer that it
@@ -149,10 +174,32 @@ void dbg (char *fmt, ...) { }
    represent.
 */
 
+#if defined (VAL_NAN) && !defined (VAL_64)
+#define VAL_64
+#endif
+
+#if defined (VAL_64) && defined (VAL_COMPRESSED)
+#error "VAL_64 and VAL_COMPRESSED don't go together"
+#endif
+
+#ifdef VAL_64
+typedef unsigned long word;
+typedef   signed long sword;
+#else
 typedef unsigned int word;
 typedef   signed int sword;
+#endif
 typedef         word val;
 
+/* The number of words needed for N bytes.
+ */
+
+word
+word_count (word n)
+{
+  return (n + sizeof (word) - 1) / sizeof (word);
+}
+
 val
 val_make (word payload, int shift, int tag)
 {
@@ -160,7 +207,7 @@ val_make (word payload, int shift, int tag)
 }
 
 #define val_make(payload, shift, tag) \
-  ((val)(((payload) << (shift))) | (tag))
+  (((val)(payload) << (shift)) | (tag))
 
 word
 val_tag (val v, int shift)
@@ -180,54 +227,273 @@ val_signed_payload (val v, int shift)
   return ((sword)v)>>shift;
 }
 
+/* Floating point numbers
+
+   With VAL_NAN, which implies VAL_64, values can also be double
+   precision floating point numbers that don't need to be stored in
+   the heap.  All other values are kept below 2^49: pointers need
+   less than 48 bits on the machines we care about, and small integers
+   are cut to 49 bits.  A double is stored as its 64 bits plus 2^49,
+   and every value at or above 2^49 is thus a double.  Only NaNs with
+   all of their upper bits set would overflow, and all NaNs are stored
+   as the same one anyway.
+
+   Seen as doubles, the other values then all live in the part of the
+   NaNs that is left out, and this is called 'NaN boxing'.  The tag of
+   a double is meaningless, and all type predicates check for doubles
+   first.  Without VAL_NAN, there are no doubles, and 'flo_p' is always
+   false.
+*/
+
+#define VAL_NAN_BITS 49
+
+bool
+flo_p (val v)
+{
+#ifdef VAL_NAN
+  return (v >> VAL_NAN_BITS) != 0;
+#else
+  return false;
+#endif
+}
+
+#ifdef VAL_NAN
+
+val
+flo_make (double d)
+{
+  word bits;
+
+  if (d != d)
+    d = __builtin_nan ("");
+  memcpy (&bits, &d, sizeof (bits));
+  return bits + ((word)1 << VAL_NAN_BITS);
+}
+
+double
+flo_num (val v)
+{
+  word bits = v - ((word)1 << VAL_NAN_BITS);
+  double d;
+
+  memcpy (&d, &bits, sizeof (d));
+  return d;
+}
+
+#endif
+
 /* Memory allocation
    
-   All new memory is allocated from a contigous region of free memory.
-   When that region runs out, the garbage collector is invoked to
-   create a new region.
+   All new memory is allocated from a contigous region of free memory,
+   the 'nursery'.  When that region runs out, the garbage collector is
+   invoked to empty it again.
+
+   The nursery and the other regions of memory used by the garbage
+   collector are described by a 'space': the range of words from
+   'first' to 'end'.  Pairs are kept apart from all other objects:
+   objects are allocated upwards from 'first' to 'next', and pairs
+   downwards from 'end' to 'pairs'.  The words between 'next' and
+   'pairs' are free.
+
+   Thus, pairs are packed densely, without headers and padding, and a
+   pointer into a space points to a pair exactly when it is at or above
+   'pairs'.
+
+   Objects and pairs are allocated quickly as long as they stay within
+   'mem_limit' and 'mem_pair_limit', respectively.  These limits divide
+   the free part of the nursery between the two kinds, and are adjusted
+   when one of them is reached.
  */
 
-val *mem_next;
-val *mem_end;
+struct mem_space {
+  val *first;
+  val *next;
+  val *pairs;
+  val *end;
+};
+
+struct mem_space mem_young;
+val *mem_limit;
+val *mem_pair_limit;
 
-val *mem_gc (int n);
+#define MEM_LARGE_SIZE 1024
+
+val *mem_gc (int n, bool pair);
+void mem_write_barrier (val *slot, val x);
+val mem_read_barrier (val *slot);
 
 val *
 mem_alloc (int n)
 {
-  val *ptr = mem_next;
-  if (ptr + n > mem_end || DEBUG_GC_BEFORE_ALLOC)
-    ptr = mem_gc (n);
+  val *ptr = mem_young.next;
+  if (ptr + n > mem_limit || n >= MEM_LARGE_SIZE)
+    return mem_gc (n, false);
+
+  mem_young.next = ptr + ((n+1)&~1);
+  return ptr;
+}
+
+/* Objects start at an even word, so that there is room for the tag
+   bits in pointers to them.  This is the start of the object that
+   follows one that ends at PTR.
+*/
+
+val *
+mem_align (val *ptr)
+{
+  return (val *)(((unsigned long)ptr + 2*sizeof (val) - 1)
+		 & ~(unsigned long)(2*sizeof (val) - 1));
+}
+
+/* Allocate a pair without collecting, or return NULL when that isn't
+   possible.
+*/
+
+val *
+mem_alloc_pair_fast ()
+{
+  val *ptr = mem_young.pairs - 2;
+  if (ptr < mem_pair_limit)
+    return NULL;
+
+  mem_young.pairs = ptr;
+  return ptr;
+}
 
-  mem_next = ptr + ((n+1)&~1);
+val *
+mem_alloc_pair ()
+{
+  val *ptr = mem_alloc_pair_fast ();
+  if (ptr == NULL)
+    return mem_gc (2, true);
   return ptr;
 }
 
+/* Stress testing
+
+   Heap corruption is found most quickly when the collector runs very
+   often, since objects are then moved right after they have been
+   allocated, and in DEBUG mode, the heap is checked before and after
+   each collection.  With the --gc-stress=N option, or SUO_GC_STRESS,
+   every Nth allocation collects, no matter how full the nursery is.
+   With N = 1, every allocation does.  When a seed is given with
+   --gc-stress-seed, or SUO_GC_STRESS_SEED, the intervals are random
+   instead, between 1 and N allocations, and the same seed always
+   produces the same schedule.
+
+   The fast paths above don't know about this.  Instead, the
+   allocation limits are closed while stress testing, so that every
+   allocation ends up in 'mem_gc', which counts them.
+*/
+
+int mem_gc_stress = 0;
+unsigned mem_gc_stress_seed = 0;
+int mem_gc_stress_countdown = 0;
+
+void
+mem_set_gc_stress (char *str)
+{
+  mem_gc_stress = atoi (str);
+  if (mem_gc_stress < 0)
+    {
+      printf ("invalid stress interval: %s\n", str);
+      exit (1);
+    }
+}
+
+void
+mem_set_gc_stress_seed (char *str)
+{
+  mem_gc_stress_seed = strtoul (str, NULL, 0);
+}
+
+/* Return whether the current allocation should collect, and start the
+   next interval if so.  The random intervals come from a xorshift
+   generator.
+*/
+
+bool
+mem_stress_due ()
+{
+  if (mem_gc_stress == 0 || --mem_gc_stress_countdown > 0)
+    return false;
+
+  if (mem_gc_stress_seed)
+    {
+      mem_gc_stress_seed ^= mem_gc_stress_seed << 13;
+      mem_gc_stress_seed ^= mem_gc_stress_seed >> 17;
+      mem_gc_stress_seed ^= mem_gc_stress_seed << 5;
+      mem_gc_stress_countdown = 1 + mem_gc_stress_seed % mem_gc_stress;
+    }
+  else
+    mem_gc_stress_countdown = mem_gc_stress;
+
+  return true;
+}
+
+void
+mem_stress_limits ()
+{
+  if (mem_gc_stress > 0)
+    {
+      mem_limit = mem_young.next;
+      mem_pair_limit = mem_young.pairs;
+    }
+}
+
 /* Values that point into the heap.
- */
+
+   Usually, the pointer in a value is just the address of its object,
+   and on 64 bit hosts, the heap must then be in the low 4 GB of the
+   address space, see 'mem_reserve'.  With VAL_COMPRESSED, it is the
+   offset of the object from 'mem_base' instead, the start of the
+   heap, which can then be anywhere.  The offset is in bytes, since
+   the tag needs its lower three bits, and the heap can thus be 4 GB
+   big, like before.
+
+   Pointers and values are only converted into each other by the
+   functions here.  A value with the tag 0 is used for an address
+   that is written to a heap image.
+*/
+
+#ifdef VAL_COMPRESSED
+char *mem_base;
+#endif
 
 bool
 val_ptr_p (val v)
 {
-  return val_tag (v, 2) != 0 && val_tag (v, 3) != 7;
+  return !flo_p (v) && val_tag (v, 2) != 0 && val_tag (v, 3) != 7;
 }
 
 val
 val_ptr_make (val *ptr, int tag)
 {
+#ifdef VAL_COMPRESSED
+  return ((char *)ptr - mem_base) + tag;
+#else
   return ((word)ptr) + tag;
+#endif
 }
 
 val *
 val_ptr (val v, int tag)
 {
+#ifdef VAL_COMPRESSED
+  return (val *)(mem_base + (v - tag));
+#else
   return (val *)(((word)v)-tag);
+#endif
 }
 
 val *
 val_ptr_any_tag (val v)
 {
+#ifdef VAL_COMPRESSED
+  return (val *)(mem_base + (v & ~7));
+#else
   return (val *)(((word)v)&~7);
+#endif
 }
 
 /* Headers
@@ -235,13 +501,16 @@ val_ptr_any_tag (val v)
    Headers are only used as the first word of vectors, byte vectors,
    and code blocks; they are illegal in any other place.  Headers
    share a 3 bit tag with the special values and characters.  Thus, we
-   need to distinguish 5 choices, and we do it with these bits:
+   need to distinguish 8 choices, and we do it with these bits:
 
-     1111 - vectors
+   001111 - vectors
+   011111 - weak vectors
+   101111 - ephemeron vectors
+   111111 - flat vectors
    000111 - byte vectors
    010111 - code blocks
    100111 - characters
-   110111 - special values
+   110111 - special values and symbols
 */
 
 word
@@ -282,7 +551,7 @@ head_payload (word h, int shift)
 bool
 chr_p (val p)
 {
-  return val_tag (p, 6) == 0x27;
+  return !flo_p (p) && val_tag (p, 6) == 0x27;
 }
 
 #define chr_make(code) val_make (code, 6, 0x27)
@@ -293,21 +562,158 @@ chr_code (val v)
   return val_payload (v, 6);
 }
 
+/* Symbols
+
+   Symbols share their tag with the special values, whose payloads are
+   all below 4, and take the next bit of the payload: a symbol is the
+   index of its name in the symbol table, with a 9 bit tag of
+   100110111.
+
+   The symbol table lives outside of the heap.  Interning a name that
+   is already in the table returns the same symbol again, so symbols
+   are compared with 'eq', and the collector never sees them.  Symbols
+   are never freed.  The names are written into heap images in the
+   order of their indices, see 'Heap images'.
+*/
+
+bool
+sym_p (val v)
+{
+  return !flo_p (v) && val_tag (v, 9) == 0x137;
+}
+
+#define sym_make(index) val_make (index, 9, 0x137)
+
+word
+sym_index (val v)
+{
+  return val_payload (v, 9);
+}
+
+struct sym_name {
+  char *bytes;
+  word len;
+};
+
+struct sym_name *sym_names;
+word sym_n, sym_size;
+
+/* The index has a power of two of slots, at least twice as many as
+   there are symbols.  A slot holds the index of a symbol plus one, or
+   zero when it is free.
+*/
+
+word *sym_slots;
+word sym_n_slots;
+
+word
+sym_hash (char *bytes, word len)
+{
+  word h = 2166136261u;
+  for (word i = 0; i < len; i++)
+    h = (h ^ (unsigned char)bytes[i]) * 16777619u;
+  return h;
+}
+
+/* The slot with the name of LEN BYTES, or the free slot where it
+   belongs.
+*/
+
+word
+sym_find (char *bytes, word len)
+{
+  word mask = sym_n_slots - 1;
+  word i = sym_hash (bytes, len) & mask;
+
+  while (sym_slots[i] != 0)
+    {
+      struct sym_name *s = &sym_names[sym_slots[i] - 1];
+      if (s->len == len && memcmp (s->bytes, bytes, len) == 0)
+	break;
+      i = (i + 1) & mask;
+    }
+  return i;
+}
+
+void
+sym_grow ()
+{
+  free (sym_slots);
+  sym_n_slots = sym_n_slots? 2*sym_n_slots : 256;
+  sym_slots = calloc (sym_n_slots, sizeof (word));
+  if (sym_slots == NULL)
+    abort ();
+
+  for (word j = 0; j < sym_n; j++)
+    sym_slots[sym_find (sym_names[j].bytes, sym_names[j].len)] = j + 1;
+}
+
+val
+sym_intern (char *bytes, word len)
+{
+  if (2*(sym_n + 1) > sym_n_slots)
+    sym_grow ();
+
+  word i = sym_find (bytes, len);
+  if (sym_slots[i] == 0)
+    {
+      if (sym_n == sym_size)
+	{
+	  sym_size = 2*sym_size + 256;
+	  sym_names = realloc (sym_names, sym_size*sizeof(struct sym_name));
+	  if (sym_names == NULL)
+	    abort ();
+	}
+
+      char *copy = malloc (len + 1);
+      memcpy (copy, bytes, len);
+      copy[len] = '\0';
+      sym_names[sym_n++] = (struct sym_name) { copy, len };
+      sym_slots[i] = sym_n;
+    }
+
+  return sym_make (sym_slots[i] - 1);
+}
+
+char *
+sym_bytes (val v)
+{
+  return sym_names[sym_index (v)].bytes;
+}
+
+word
+sym_len (val v)
+{
+  return sym_names[sym_index (v)].len;
+}
+
 
 /* Small integers
 
-   Small integers only use the lower two bits as the tag.
+   Small integers only use the lower two bits as the tag.  With NaN
+   boxing, they only have 47 bits.
 */
 
-const sword fixnum_min = -536870912;
-const sword fixnum_max =  536870911;
+#ifdef VAL_NAN
 
-bool
-fixnum_p (val v)
+const sword fixnum_min = -((sword)1 << (VAL_NAN_BITS - 3));
+const sword fixnum_max =  ((sword)1 << (VAL_NAN_BITS - 3)) - 1;
+
+#define fixnum_make(n) \
+  (val_make (n, 2, 0) & (((word)1 << VAL_NAN_BITS) - 1))
+
+sword
+fixnum_num (val v)
 {
-  return val_tag (v, 2) == 0;
+  int unused = 8*sizeof (word) - VAL_NAN_BITS;
+  return val_signed_payload (v << unused, unused + 2);
 }
 
+#else
+
+const sword fixnum_min = -((sword)1 << (8*sizeof (word) - 3));
+const sword fixnum_max =  ((sword)1 << (8*sizeof (word) - 3)) - 1;
+
 #define fixnum_make(n) val_make (n, 2, 0)
 
 sword
@@ -316,32 +722,27 @@ fixnum_num (val v)
   return val_signed_payload (v, 2);
 }
 
-/* Pairs
- */
+#endif
 
 bool
-pair_p (val v)
+fixnum_p (val v)
 {
-  return val_tag (v, 3) == 1;
+  return !flo_p (v) && val_tag (v, 2) == 0;
 }
 
+/* Pairs
+ */
+
 bool
-pair_ptr_p (val *v)
+pair_p (val v)
 {
-  /* This is the price we pay for wanting to represent pairs with only
-     two words.
-  */
-  if (head_tag (v[0], 3) == 7)
-    return (head_tag (v[0], 6) == 0x27
-	    || head_tag (v[0], 6) == 0x37);
-  else
-    return head_tag (v[0], 3) != 6;
+  return !flo_p (v) && val_tag (v, 3) == 1;
 }
 
 val
 pair_alloc ()
 {
-  val *ptr = mem_alloc (2);
+  val *ptr = mem_alloc_pair ();
   return val_ptr_make (ptr, 1);
 }
 
@@ -359,7 +760,7 @@ pair_ptr (val v)
 bool
 vec_p (val v)
 {
-  return val_tag (v, 3) == 2;
+  return !flo_p (v) && val_tag (v, 3) == 2;
 }
 
 bool
@@ -372,14 +773,14 @@ val
 vec_alloc (word len)
 {
   val *ptr = mem_alloc (len + 1);
-  ptr[0] = head_make (len, 4, 15);
+  ptr[0] = head_make (len, 6, 0x0f);
   return val_ptr_make (ptr, 2);
 }
 
 word
 vec_ptr_len (val *v)
 {
-  return head_payload (v[0], 4);
+  return head_payload (v[0], 6);
 }
 
 word
@@ -394,6 +795,67 @@ vec_ptr (val v)
   return val_ptr (v, 2) + 1;
 }
 
+/* Weak vectors and ephemeron vectors
+
+   These are vectors that the garbage collector treats specially, see
+   'Weak references'.  Just like every code block is also a byte
+   vector, they are also vectors: they have the vector tag, and all
+   vector accessors work on them.  Only their headers are different.
+
+   An ephemeron vector holds key/value pairs, with the keys in the
+   even fields and their values in the odd ones.
+*/
+
+bool
+weak_ptr_p (val *v)
+{
+  return head_tag (v[0], 6) == 0x1f;
+}
+
+val
+weak_alloc (word len)
+{
+  val *ptr = mem_alloc (len + 1);
+  ptr[0] = head_make (len, 6, 0x1f);
+  return val_ptr_make (ptr, 2);
+}
+
+bool
+eph_ptr_p (val *v)
+{
+  return head_tag (v[0], 6) == 0x2f;
+}
+
+val
+eph_alloc (word n)
+{
+  val *ptr = mem_alloc (2*n + 1);
+  ptr[0] = head_make (2*n, 6, 0x2f);
+  return val_ptr_make (ptr, 2);
+}
+
+/* Flat vectors
+
+   A flat vector is a vector that never holds a pointer into the heap,
+   only small integers, characters, and the special values.  The
+   garbage collector skips over its fields without looking at them.
+   Debug builds check every store into one.
+*/
+
+bool
+flat_ptr_p (val *v)
+{
+  return head_tag (v[0], 6) == 0x3f;
+}
+
+val
+flat_alloc (word len)
+{
+  val *ptr = mem_alloc (len + 1);
+  ptr[0] = head_make (len, 6, 0x3f);
+  return val_ptr_make (ptr, 2);
+}
+
 /* Byte vectors
 
    Byte vectors and code blocks have to share a tag since there aren't
@@ -408,7 +870,7 @@ vec_ptr (val v)
 bool
 bytev_p (val v)
 {
-  return val_tag (v, 3) == 5;
+  return !flo_p (v) && val_tag (v, 3) == 5;
 }
 
 bool
@@ -420,7 +882,7 @@ bytev_ptr_p (val *v)
 val
 bytev_alloc (word len)
 {
-  val *ptr = mem_alloc ((len+3)/4 + 1);
+  val *ptr = mem_alloc (word_count (len) + 1);
   ptr[0] = head_make (len, 6, 7);
   return val_ptr_make (ptr, 5);
 }
@@ -457,7 +919,7 @@ code_ptr_p (val *v)
 word
 code_ptr_lit_begin (val *v)
 {
-  return (bytev_ptr_len (v) + 3) / 4;
+  return word_count (bytev_ptr_len (v));
 }
 
 word
@@ -507,7 +969,7 @@ code_lit_end (val v)
 bool
 rec_p (val v)
 {
-  return val_tag (v, 3) == 3;
+  return !flo_p (v) && val_tag (v, 3) == 3;
 }
 
 bool
@@ -539,6 +1001,7 @@ void
 rec_set_desc (val v, val desc)
 {
   rec_ptr(v)[-1] = rec_header_make (desc);
+  mem_write_barrier (rec_ptr(v) - 1, rec_ptr(v)[-1]);
 }
 
 val
@@ -550,7 +1013,8 @@ rec_ptr_desc (val *v)
 val
 rec_desc (val v)
 {
-  return rec_ptr_desc (val_ptr (v,3));
+  val h = mem_read_barrier (val_ptr (v,3));
+  return rec_ptr_desc (&h);
 }
 
 /* Garbage collection
@@ -564,329 +1028,5168 @@ rec_desc (val v)
    values are found in storage locations that are explicitly
    registered with the garbage collector.  This is set of root
    locations is quote smalle and pretty static.
+
+   Most objects die young: the frames and argument vectors of the
+   evaluator, for example, are garbage almost as soon as they have
+   been created.  Copying the whole heap every time the nursery is
+   full would thus mostly copy the same old objects over and over
+   again.  Instead, the heap is split into two generations.
+
+   New objects are allocated in the small nursery, the 'young'
+   generation.  When the nursery is full, a 'minor' collection copies
+   the objects in it that are still alive to the end of the 'old'
+   generation, and the nursery is empty again.  A minor collection
+   does not look at old objects at all, except for the few that have
+   been modified to point to young objects (see below).  Its cost is
+   thus proportional to the amount of young data that survives, not to
+   the size of the heap.
+
+   Only when the old generation is too full to receive the survivors
+   of the next minor collection do we perform a 'major' collection.
+   It copies all living objects of both generations into the 'spare'
+   region, which then becomes the new old generation.  The region that
+   previously held the old generation becomes the spare region, and is
+   reused for the next major collection.
+
+   The size of the old generation adapts to the amount of data that
+   survives a major collection: it is grown when less than half of it
+   would be free, and it is shrunk again when it is more than twice as
+   big as necessary.  A new size takes effect when the spare region is
+   used for the next time.  If the old generation is still too small
+   after a major collection, we collect a second time right away, into
+   the freshly grown spare region.
+
+   The initial and maximum size of the old generation can be set with
+   the --heap-size and --heap-max command line options, or the
+   SUO_HEAP_SIZE and SUO_HEAP_MAX environment variables.  The heap
+   never shrinks below its initial size.
  */
 
-const word mem_size = 217000;
-val *mem_first;
+const word mem_young_size = 32768;
+word mem_size = 217000;
+word mem_max_size = 64*1024*1024;
+const double mem_target_live_ratio = 0.5;
+
+struct mem_space mem_old;
+struct mem_space mem_spare;
 
-val *mem_roots[200];
+/* The root locations are kept on a stack that grows as needed, see
+   GC_PROTECT below.
+*/
+
+val **mem_roots;
 int mem_n_roots = 0;
+int mem_roots_size = 0;
 
 void
-mem_init ()
+mem_protect (val *loc)
 {
-  mem_first = malloc (mem_size*4);
-  if (mem_first == NULL)
-    abort ();
+  if (mem_n_roots == mem_roots_size)
+    {
+      mem_roots_size = 2*mem_roots_size + 256;
+      mem_roots = realloc (mem_roots, mem_roots_size*sizeof(val *));
+      if (mem_roots == NULL)
+	abort ();
+    }
 
-  mem_next = mem_first;
-  mem_end = mem_next + mem_size;
+  mem_roots[mem_n_roots++] = loc;
 }
 
-/* The garbage collection algorithm itself consists of two functions:
-   'copy' and 'scan'.  The 'copy' function copies one object to the
-   new region without changing its content, while the 'scan' function
-   examines each word of an object and calls 'copy' to move all
-   referenced objects into the new memory region.
+/* Sizes are given in bytes, with an optional 'k', 'm', or 'g'
+   suffix, but are kept in words.
+*/
 
-   The collection starts with calling 'copy' for each root location.
-   This will give us a number of objects in the new memory region.
-   Then we call 'scan' in a loop for each object in the new region,
-   starting at the beginning of the region and working towards its
-   end.  Since 'scan' calls 'copy', more objects will appear in the
-   new region as we scan, and we will eventually reach them with our
-   'scan' loop.
+word
+mem_parse_size (char *str)
+{
+  char *end;
+  unsigned long n = strtoul (str, &end, 10);
 
-   Note that 'scan' calls 'copy', but 'copy' never calls 'scan'.  The
-   algorithm is not recursive.  This is important since recursing for
-   deeply nested data structures might overflow the call stack.
- */
+  if (*end == 'k' || *end == 'K')
+    n <<= 10, end++;
+  else if (*end == 'm' || *end == 'M')
+    n <<= 20, end++;
+  else if (*end == 'g' || *end == 'G')
+    n <<= 30, end++;
 
-val pk (char *title, val x);
+  if (*end || n == 0 || n/sizeof (val) > ((word)-1 >> 3))
+    {
+      printf ("invalid size: %s\n", str);
+      exit (1);
+    }
 
-val *mem_new_first;
-val *mem_new_end;
-val *mem_new_next;
+  return n/sizeof (val);
+}
 
 void
-mem_install_fwd_ptr (val *old, val *new)
+mem_set_size (char *str)
 {
-  old[0] = val_ptr_make (new, 1);
+  mem_size = mem_parse_size (str);
 }
 
-val *
-mem_follow_fwd_ptr (val *ptr)
+void
+mem_set_max_size (char *str)
 {
-  word w = ptr[0];
-  if (val_tag (w, 3) == 1 &&
-      val_ptr (w, 1) >= mem_new_first && val_ptr (w, 1) < mem_new_end)
-    return val_ptr (w, 1);
-  else
+  mem_max_size = mem_parse_size (str);
+}
+
+word mem_min_size;
+word mem_large_limit;
+
+/* The memory for the spaces is not allocated with malloc.  Instead,
+   one big range of virtual memory is reserved with mmap when Suo
+   starts: room for the nursery, followed by two 'slots' of the maximum
+   heap size.  The old generation and the spare region each occupy one
+   of the slots, and the operating system only provides real memory for
+   the pages that are actually touched.
+
+   The slots are aligned to huge pages, and the kernel is asked to back
+   the spaces with them, which saves a lot of TLB misses for big heaps.
+   When a region has been evacuated by a collection, its pages are
+   given back to the operating system with MADV_DONTNEED.  Thus, the
+   process doesn't hold on to its peak heap size forever.
+
+   Values can only hold 32 bit pointers, so on 64 bit hosts the range
+   must be reserved in the low part of the address space, unless this
+   is the 64bit version.  When a heap image is loaded, the range is
+   reserved at 'mem_reserve_hint' if possible, see 'Heap images'.
+
+   With compressed values, the range can be anywhere, but it must not
+   be bigger than 4 GB.  Whenever values are narrower than the
+   pointers of the host, the range has a third slot for the large
+   objects, which must be within reach as well, see 'The large object
+   space'.
+*/
+
+#define MEM_HUGE_PAGE (2*1024*1024)
+
+#if defined (VAL_COMPRESSED) || (!defined (VAL_64) && __SIZEOF_POINTER__ > 4)
+#define MEM_LARGE_SLOT
+#endif
+
+#ifdef MEM_LARGE_SLOT
+char *mem_large_next, *mem_large_end;
+#endif
+
+val *mem_slots[2];
+bool mem_slot_used[2];
+bool mem_slot_mapped[2];
+word mem_slot_size;
+val *mem_reserve_hint;
+
+void
+mem_reserve ()
+{
+  word young = ((mem_young_size*sizeof (val) + MEM_HUGE_PAGE-1)
+		/ MEM_HUGE_PAGE);
+  word slot = (((unsigned long)mem_max_size*sizeof (val) + MEM_HUGE_PAGE-1)
+	       / MEM_HUGE_PAGE);
+#ifdef MEM_LARGE_SLOT
+  size_t bytes = (size_t)(young + 3*slot + 1) * MEM_HUGE_PAGE;
+  if (bytes > 0xffffffffUL)
+    {
+      printf ("heap too big for 32 bit values\n");
+      exit (1);
+    }
+#else
+  size_t bytes = (size_t)(young + 2*slot + 1) * MEM_HUGE_PAGE;
+#endif
+
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+#if defined (MAP_32BIT) && !defined (VAL_COMPRESSED)
+  if (sizeof (void *) > sizeof (word))
+    flags |= MAP_32BIT;
+#endif
+
+  char *base = mmap (mem_reserve_hint, bytes, PROT_READ | PROT_WRITE, flags,
+		     -1, 0);
+#if defined (MAP_32BIT) && defined (MEM_LARGE_SLOT) \
+    && !defined (VAL_COMPRESSED)
+  /* MAP_32BIT only covers the low 2 GB, and a boot image might have
+     taken most of it already.  The rest of the low 4 GB is tried then.
+  */
+  if (base == MAP_FAILED && (flags & MAP_32BIT))
+    {
+      base = mmap ((void *)0x80000000UL, bytes, PROT_READ | PROT_WRITE,
+		   flags & ~MAP_32BIT, -1, 0);
+      if (base != MAP_FAILED && (unsigned long)base + bytes > 0x100000000UL)
+	{
+	  munmap (base, bytes);
+	  base = MAP_FAILED;
+	}
+    }
+#endif
+  if (base == MAP_FAILED)
+    {
+      printf ("can't reserve %lu bytes for the heap\n", (unsigned long)bytes);
+      exit (1);
+    }
+
+  base = (char *)(((unsigned long)base + MEM_HUGE_PAGE-1)
+		  & ~(unsigned long)(MEM_HUGE_PAGE-1));
+
+  mem_slot_size = slot * (MEM_HUGE_PAGE/sizeof (val));
+  mem_slots[0] = (val *)(base + young*MEM_HUGE_PAGE);
+  mem_slots[1] = mem_slots[0] + mem_slot_size;
+
+  mem_young.first = (val *)base;
+#ifdef VAL_COMPRESSED
+  mem_base = base;
+#endif
+#ifdef MEM_LARGE_SLOT
+  mem_large_next = (char *)(mem_slots[1] + mem_slot_size);
+  mem_large_end = mem_large_next + mem_slot_size*sizeof (val);
+#endif
+}
+
+void
+mem_pages_huge (val *ptr, word size)
+{
+#ifdef MADV_HUGEPAGE
+  madvise (ptr, size*sizeof (val), MADV_HUGEPAGE);
+#endif
+}
+
+void
+mem_pages_release (val *ptr, word size)
+{
+  madvise (ptr, size*sizeof (val), MADV_DONTNEED);
+}
+
+/* Spaces have an even number of words, so that pairs at their ends
+   are aligned.
+*/
+
+void
+mem_space_init (struct mem_space *s, val *first, word size)
+{
+  s->first = s->next = first;
+  s->end = s->pairs = s->first + size;
+  mem_pages_huge (s->first, size);
+}
+
+void
+mem_space_alloc (struct mem_space *s, word size)
+{
+  size = (size+1)&~1;
+  if (size > mem_slot_size)
+    abort ();
+
+  for (int i = 0; i < 2; i++)
+    if (!mem_slot_used[i])
+      {
+	mem_slot_used[i] = true;
+	mem_space_init (s, mem_slots[i], size);
+	return;
+      }
+
+  abort ();
+}
+
+/* Give the memory of a space back to the operating system, but keep
+   the space.  Pages that are mapped from an image would be read from
+   the file again, so the slot gets fresh anonymous memory instead.
+*/
+
+void
+mem_space_release (struct mem_space *s)
+{
+  for (int i = 0; i < 2; i++)
+    if (s->first == mem_slots[i] && mem_slot_mapped[i])
+      {
+	if (mmap (mem_slots[i], mem_slot_size*sizeof (val), PROT_READ | PROT_WRITE,
+		  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+		  -1, 0) == MAP_FAILED)
+	  abort ();
+	mem_slot_mapped[i] = false;
+      }
+
+  mem_pages_release (s->first, s->end - s->first);
+}
+
+void
+mem_space_free (struct mem_space *s)
+{
+  for (int i = 0; i < 2; i++)
+    if (s->first == mem_slots[i])
+      {
+	mem_space_release (s);
+	mem_slot_used[i] = false;
+      }
+
+  s->first = s->next = s->pairs = s->end = NULL;
+}
+
+word
+mem_space_used (struct mem_space *s)
+{
+  return (s->next - s->first) + (s->end - s->pairs);
+}
+
+bool
+mem_space_pair_p (struct mem_space *s, val *ptr)
+{
+  return ptr >= s->pairs && ptr < s->end;
+}
+
+void
+mem_init ()
+{
+  if (mem_size < 2*mem_young_size)
+    mem_size = 2*mem_young_size;
+  if (mem_max_size < mem_size)
+    mem_max_size = mem_size;
+  mem_min_size = mem_size;
+
+  mem_reserve ();
+  mem_space_init (&mem_young, mem_young.first, mem_young_size);
+  mem_space_alloc (&mem_old, mem_size);
+#ifndef GC_CONSERVATIVE
+  mem_space_alloc (&mem_spare, mem_size);
+#endif
+
+  mem_limit = mem_pair_limit = mem_young.first + mem_young_size/2;
+  mem_stress_limits ();
+  mem_large_limit = mem_size;
+}
+
+bool
+mem_young_p (val *ptr)
+{
+  return ptr >= mem_young.first && ptr < mem_young.end;
+}
+
+/* The write barrier and the remembered set
+
+   A minor collection finds the living young objects by following
+   pointers from the roots, but an old object might also point to a
+   young one.  Such a pointer can only be created by storing a young
+   value into an old object, since old objects are older than all
+   young ones by definition.
+
+   Thus, every store into the heap goes through 'mem_write_barrier',
+   which records the address of the modified location in the
+   'remembered set' when it creates a pointer from outside the nursery
+   into it.  A minor collection treats all remembered locations as
+   additional roots.  After a collection, the nursery is empty and no
+   such pointers exist anymore, and the remembered set is cleared.
+
+   The same location might be remembered more than once.  This is
+   harmless, and we only avoid the most obvious repetitions.
+*/
+
+val **mem_remset;
+int mem_remset_n = 0;
+int mem_remset_size = 0;
+
+void
+mem_remember (val *slot)
+{
+  if (mem_remset_n > 0 && mem_remset[mem_remset_n-1] == slot)
+    return;
+
+  if (mem_remset_n == mem_remset_size)
+    {
+      mem_remset_size = 2*mem_remset_size + 256;
+      mem_remset = realloc (mem_remset, mem_remset_size*sizeof(val *));
+      if (mem_remset == NULL)
+	abort ();
+    }
+
+  mem_remset[mem_remset_n++] = slot;
+}
+
+/* The permanent space
+
+   A boot image can also be mapped as a 'permanent space', with
+   --boot-image=FILE or SUO_BOOT_IMAGE, instead of being loaded into
+   the old generation.  Its pages are mapped privately from the file at
+   the addresses that they had when the image was written, so all
+   processes that use the same image share them through the page cache
+   until they write to them.  The collector never copies, marks, or
+   scans the objects in it.
+
+   Objects in the permanent space initially only refer to each other.
+   The write barrier records every location in it that gets a pointer
+   to any other object, and all collections treat these locations as
+   additional roots, forever.  Each location is recorded once.
+*/
+
+struct mem_space mem_perm;
+val **mem_perm_slots;
+int mem_perm_n = 0;
+int mem_perm_size = 0;
+word *mem_perm_bits;
+
+bool
+mem_perm_p (val *ptr)
+{
+  return ptr >= mem_perm.first && ptr < mem_perm.end;
+}
+
+void
+mem_perm_remember (val *slot)
+{
+  word i = slot - mem_perm.first;
+  if (mem_perm_bits[i/32] & (1u << i%32))
+    return;
+  mem_perm_bits[i/32] |= 1u << i%32;
+
+  if (mem_perm_n == mem_perm_size)
+    {
+      mem_perm_size = 2*mem_perm_size + 256;
+      mem_perm_slots = realloc (mem_perm_slots, mem_perm_size*sizeof(val *));
+      if (mem_perm_slots == NULL)
+	abort ();
+    }
+
+  mem_perm_slots[mem_perm_n++] = slot;
+}
+
+void
+mem_write_barrier (val *slot, val x)
+{
+  if (!val_ptr_p (x))
+    return;
+
+  if (mem_perm_p (slot))
+    {
+      if (!mem_perm_p (val_ptr_any_tag (x)))
+	mem_perm_remember (slot);
+    }
+  else if (mem_young_p (val_ptr_any_tag (x)) && !mem_young_p (slot))
+    mem_remember (slot);
+}
+
+/* The large object space
+
+   Copying a big vector or byte vector on every collection costs a lot
+   and achieves little.  Objects of at least MEM_LARGE_SIZE words are
+   therefore not allocated in the nursery, but individually with
+   malloc, and they never move.  Together they form the 'large object
+   space'.  Large objects count as old: stores into them go through the
+   write barrier like stores into the old generation, and minor
+   collections ignore them.
+
+   During a major collection, the large objects are collected by
+   marking and sweeping.  Instead of copying a large object, 'copy'
+   sets its mark bit and puts it on the 'gray' list, and the collector
+   scans the objects on that list in place, just like it scans the
+   objects in the new region.  Afterwards, all large objects that have
+   not been marked are freed.
+
+   Every large object is preceded by a small header that links it
+   into the list of all large objects.  A pointer that doesn't point
+   into any of the other spaces points to a large object.
+
+   Allocating large objects does not fill the nursery, so the large
+   object space triggers major collections on its own: whenever it has
+   grown beyond twice the size of its living data after the last
+   major collection.
+*/
+
+struct mem_large {
+  struct mem_large *next;
+  struct mem_large *gray;
+  word size;
+  int mark;
+  val obj[] __attribute__ ((aligned (2*sizeof (val))));
+};
+
+struct mem_large *mem_large_objs;
+struct mem_large *mem_large_gray;
+struct mem_large *mem_large_dead;
+word mem_large_words = 0;
+bool mem_marking = false;
+
+struct mem_large *
+mem_large_header (val *ptr)
+{
+  return (struct mem_large *)((char *)ptr - offsetof (struct mem_large, obj));
+}
+
+/* Large objects are allocated with malloc, except when values are
+   narrower than the pointers of the host, where malloc might put them
+   out of reach: with compressed values, and with 32 bit values on a 64
+   bit host, where the program might be a PIE.  They are then allocated
+   from the third slot of the heap range instead: from a list of free
+   blocks, sorted by address, with the first one that is big enough, or
+   from the untouched rest of the slot.  Freed blocks are merged with
+   their neighbours, and their pages are given back to the operating
+   system.
+*/
+
+word
+mem_large_bytes (word size)
+{
+  return ((offsetof (struct mem_large, obj) + size*sizeof (val) + 15)
+	  & ~(word)15);
+}
+
+#ifdef MEM_LARGE_SLOT
+
+struct mem_large_block {
+  struct mem_large_block *next;
+  size_t size;
+};
+
+struct mem_large_block *mem_large_free_blocks;
+
+void *
+mem_large_malloc (size_t size)
+{
+  struct mem_large_block **bp, *b;
+
+  for (bp = &mem_large_free_blocks; (b = *bp); bp = &b->next)
+    if (b->size >= size)
+      {
+	if (b->size > size)
+	  {
+	    struct mem_large_block *rest = (void *)((char *)b + size);
+	    rest->next = b->next;
+	    rest->size = b->size - size;
+	    *bp = rest;
+	  }
+	else
+	  *bp = b->next;
+	return b;
+      }
+
+  if (mem_large_next + size > mem_large_end)
+    return NULL;
+  b = (void *)mem_large_next;
+  mem_large_next += size;
+  return b;
+}
+
+void
+mem_large_release (char *lo, char *hi)
+{
+  word page = getpagesize ();
+  lo = (char *)(((unsigned long)lo + page-1) & ~(unsigned long)(page-1));
+  hi = (char *)((unsigned long)hi & ~(unsigned long)(page-1));
+  if (lo < hi)
+    madvise (lo, hi - lo, MADV_DONTNEED);
+}
+
+void
+mem_large_mfree (void *ptr, size_t size)
+{
+  struct mem_large_block **bp, *b = ptr, *prev = NULL;
+
+  for (bp = &mem_large_free_blocks; *bp && *bp < b; bp = &(*bp)->next)
+    prev = *bp;
+
+  b->size = size;
+  b->next = *bp;
+  if (b->next && (char *)b + b->size == (char *)b->next)
+    {
+      b->size += b->next->size;
+      b->next = b->next->next;
+    }
+  if (prev && (char *)prev + prev->size == (char *)b)
+    {
+      prev->size += b->size;
+      prev->next = b->next;
+      b = prev;
+    }
+  else
+    *bp = b;
+
+  if ((char *)b + b->size == mem_large_next)
+    {
+      for (bp = &mem_large_free_blocks; *bp != b; bp = &(*bp)->next)
+	;
+      *bp = NULL;
+      mem_large_next = (char *)b;
+      mem_large_release ((char *)b, (char *)b + b->size);
+    }
+  else
+    mem_large_release ((char *)(b + 1), (char *)b + b->size);
+}
+
+#else
+
+void *
+mem_large_malloc (size_t size)
+{
+  return malloc (size);
+}
+
+void
+mem_large_mfree (void *ptr, size_t size)
+{
+  free (ptr);
+}
+
+#endif
+
+/* Statistics
+
+   The collector counts what it does in 'mem_stats', so that the heap
+   sizes can be tuned.  Every call of 'mem_gc' that collects something
+   writes one line of JSON with the numbers for that call to the file
+   given with the --gc-stats option or the SUO_GC_STATS environment
+   variable.  At exit, a last line has the totals and a histogram of
+   all pause times.  Suo code can get the totals with [#@gc-stats].
+
+   Copied objects are counted by kind.  Sizes are counted in words,
+   but reported in bytes.
+*/
+
+enum {
+  mem_kind_pair,
+  mem_kind_vec,
+  mem_kind_bytev,
+  mem_kind_code,
+  mem_kind_rec,
+
+  mem_n_kinds
+};
+
+char *mem_kind_names[mem_n_kinds] = {
+  "pair", "vector", "bytevector", "code", "record"
+};
+
+#define MEM_STATS_MINOR   1
+#define MEM_STATS_MAJOR   2
+#define MEM_STATS_COMPACT 4
+#define MEM_STATS_INCR    8
+
+/* Bucket I of the histogram counts the pauses that took less than 2^I
+   microseconds, the last one counts all longer ones.  Only the calls
+   of 'mem_gc' that collect something are pauses; those that just move
+   the limits of the nursery are not.
+*/
+
+#define MEM_PAUSE_BUCKETS 20
+
+struct mem_copy_stats {
+  unsigned long objects[mem_n_kinds];
+  unsigned long words[mem_n_kinds];
+};
+
+struct mem_stats {
+  unsigned long collections;
+  unsigned long minor, major, compact, incr_steps;
+  unsigned long allocated;
+  struct mem_copy_stats copied;
+  unsigned long pauses[MEM_PAUSE_BUCKETS];
+};
+
+struct mem_stats mem_stats;
+
+char *mem_stats_name;
+FILE *mem_stats_file;
+
+/* The numbers for the current call of 'mem_gc'.
+ */
+int mem_stats_what;
+unsigned long mem_stats_allocated;
+word mem_stats_young_used;
+double mem_stats_survival;
+struct mem_copy_stats mem_stats_copied;
+
+void
+mem_set_stats_file (char *str)
+{
+  mem_stats_name = str;
+}
+
+void
+mem_stats_open ()
+{
+  mem_stats_file = fopen (mem_stats_name, "w");
+  if (mem_stats_file == NULL)
+    {
+      printf ("can't open %s\n", mem_stats_name);
+      exit (1);
+    }
+}
+
+void
+mem_stats_count (struct mem_copy_stats *c, word head, sword size, bool pair)
+{
+  val *h = &head;
+  int kind;
+
+  if (pair)
+    kind = mem_kind_pair;
+  else if (vec_ptr_p (h))
+    kind = mem_kind_vec;
+  else if (bytev_ptr_p (h))
+    kind = mem_kind_bytev;
+  else if (code_ptr_p (h))
+    kind = mem_kind_code;
+  else
+    kind = mem_kind_rec;
+
+  c->objects[kind]++;
+  c->words[kind] += size;
+}
+
+word
+mem_stats_words (struct mem_copy_stats *c)
+{
+  word n = 0;
+  for (int i = 0; i < mem_n_kinds; i++)
+    n += c->words[i];
+  return n;
+}
+
+void
+mem_stats_add (struct mem_copy_stats *to, struct mem_copy_stats *from)
+{
+  for (int i = 0; i < mem_n_kinds; i++)
+    {
+      to->objects[i] += from->objects[i];
+      to->words[i] += from->words[i];
+    }
+}
+
+/* The garbage collection algorithm itself consists of two functions:
+   'copy' and 'scan'.  The 'copy' function copies one object to the
+   new region without changing its content, while the 'scan' function
+   examines each word of an object and calls 'copy' to move all
+   referenced objects into the new memory region.
+
+   The collection starts with calling 'copy' for each root location.
+   This will give us a number of objects in the new memory region.
+   Then we call 'scan' in a loop for each object in the new region,
+   starting at the beginning of the region and working towards its
+   end.  Since 'scan' calls 'copy', more objects will appear in the
+   new region as we scan, and we will eventually reach them with our
+   'scan' loop.  Pairs are scanned by a second loop that starts at the
+   end of the region and works downwards.
+
+   Note that 'scan' calls 'copy', but 'copy' never calls 'scan'.  The
+   algorithm is not recursive.  This is important since recursing for
+   deeply nested data structures might overflow the call stack.
+
+   A plain Cheney scan copies objects in breadth first order, which
+   scatters the pairs of a list all over the new region when they are
+   reached from many places at once.  Thus, whenever 'copy' copies a
+   pair, it also copies the chain of pairs in its cdr right away, up to
+   'mem_cdr_chain' of them.  The pairs of a list then end up next to
+   each other, in the order in which they are traversed.  While
+   scanning, the objects that are referenced by the next few fields are
+   prefetched, since copying them touches their first words.
+
+   Only objects in the 'from' spaces of the current collection are
+   copied; all other pointers are left alone.  For a minor collection,
+   that is just the nursery, and the new region is the free part at
+   the end of the old generation.  For a major collection, the old
+   generation is a from space as well, and the new region is the spare
+   region.  Objects are copied to the 'to' space, which is usually the
+   new region.  Large objects are marked instead of copied during major
+   collections.
+ */
+
+val pk (char *title, val x);
+
+struct mem_space mem_from;
+bool mem_from_young;
+struct mem_space mem_new;
+struct mem_space *mem_to;
+
+void
+mem_install_fwd_ptr (val *old, val *new)
+{
+  old[0] = val_ptr_make (new, 1);
+}
+
+#ifdef GC_CONSERVATIVE
+bool mem_island_p (val *ptr);
+#endif
+
+/* A pair in the to space might also be an island, see 'Conservative
+   roots'.
+*/
+
+bool
+mem_fwd_ptr_p (word w)
+{
+  return (val_tag (w, 3) == 1 &&
+	  val_ptr (w, 1) >= mem_to->first && val_ptr (w, 1) < mem_to->end
+#ifdef GC_CONSERVATIVE
+	  && !mem_island_p (val_ptr (w, 1))
+#endif
+	  );
+}
+
+val *
+mem_follow_fwd_ptr (val *ptr)
+{
+  word w = __atomic_load_n (&ptr[0], __ATOMIC_ACQUIRE);
+  if (mem_to && mem_fwd_ptr_p (w))
+    return val_ptr (w, 1);
+  else
     return ptr;
 
 }
 
-val
-mem_copy (val v)
+bool
+mem_from_p (val *ptr)
+{
+  return ((mem_from_young && mem_young_p (ptr))
+	  || (ptr >= mem_from.first && ptr < mem_from.end));
+}
+
+bool
+mem_large_p (val *ptr)
+{
+  return !(mem_young_p (ptr)
+	   || mem_perm_p (ptr)
+	   || (ptr >= mem_old.first && ptr < mem_old.end)
+	   || (ptr >= mem_from.first && ptr < mem_from.end)
+	   || (mem_to && ptr >= mem_to->first && ptr < mem_to->end));
+}
+
+/* The size of the object at PTR, in words.  The first word of the
+   object is passed separately: in a parallel collection, another
+   thread might replace it with a forwarding pointer at any time, and
+   we must not look at it twice.
+*/
+
+sword
+mem_obj_size (val *ptr, word head)
+{
+  val *h = &head;
+
+  if (vec_ptr_p (h))
+    return vec_ptr_len (h) + 1;
+  else if (bytev_ptr_p (h))
+    return word_count (bytev_ptr_len (h)) + 1;
+  else if (code_ptr_p (h))
+    return ptr[code_ptr_lit_begin (h) - 1] + 1;
+  else if (rec_ptr_p (h))
+    {
+      /* The descriptor might have already been copied and thus we
+	 might find a forwarding pointer in its place.
+      */
+      val *desc_ptr = mem_follow_fwd_ptr (val_ptr(rec_ptr_desc (h),3));
+      return labs (fixnum_num (desc_ptr[1])) + 1;
+    }
+  else
+    abort ();
+}
+
+bool
+mem_bit (word *bits, word i)
+{
+  return bits[i/32] & (1u << i%32);
+}
+
+void
+mem_set_bits (word *bits, word i, word n)
+{
+  for (word j = i; j < i + n; j++)
+    bits[j/32] |= 1u << j%32;
+}
+
+/* A pinned object stays where it is during a collection.  Only
+   conservative builds pin objects, see below.
+*/
+
+struct mem_pin {
+  val *ptr;
+  word size;
+  bool pair;
+};
+
+#ifdef GC_CONSERVATIVE
+
+/* Conservative roots
+
+   When Suo is compiled with GC_CONSERVATIVE, the interpreter doesn't
+   register its local variables with the collector, and GC_PROTECT
+   does nothing.  Instead, the collector scans the C stack and the
+   registers for words that look like pointers into the heap.  Such a
+   word might just be a number that happens to look like a pointer, so
+   the collector must not change it.  The object that it points into is
+   'pinned' instead: it is kept alive, and it doesn't move.  A word
+   that points anywhere into an object pins it, since the compiler
+   might only keep a pointer to the middle of an object around.  All
+   other objects are still collected precisely, starting from the
+   pinned objects and the global roots, which are still registered with
+   GC_PROTECT_GLOBAL.
+
+   The words on the stack are collected into the 'ambiguous roots' once
+   per call of 'mem_gc', before anything moves.  Each collection during
+   that call then finds the objects that they point into.  To find the
+   start of an object that contains a given word, the object part of
+   its space is walked once and the starts are noted in a bitmap.  A
+   word in the pair part of a space belongs to the pair that starts at
+   the even word at or below it.
+
+   A minor collection copies the young objects that are not pinned as
+   usual, and scans the pinned ones in place.  The pinned objects stay
+   in the nursery as 'islands' in its free part, see below, and the
+   nursery is otherwise empty again.  Old objects that still refer to a
+   pinned young object are remembered again.
+
+   Since pinned old objects can't be copied into the spare region,
+   major collections always compact the old generation, and the
+   compactor leaves the pinned objects where they are.  The old
+   generation starts at the beginning of its slot (see 'mem_reserve'),
+   so it is grown in place when compaction doesn't free enough room.
+   It never shrinks.
+
+   A pinned old pair would limit the free part of the old generation
+   to the room below it, since pairs must stay above 'pairs'.  Thus,
+   the compactor packs the other pairs at the end of the space, and
+   leaves the pinned pairs below them as islands in the free part.
+
+   Objects and pairs are allocated around the islands of a space by
+   'mem_hole_alloc'; in the nursery, the allocation limits stop in
+   front of them.  Pairs skip over pinned pairs, which are simply part
+   of the pair part again, but stop at a pinned object.  Objects skip
+   over pinned objects, which are part of the object part then.  When
+   an object doesn't fit below a pinned pair, the pair is wrapped into
+   a vector whose header takes the two words below it, so that the
+   object part can still be walked, and the object is allocated above
+   it.  A pointer to a wrapped pair is found in the object part of its
+   space; the vector that contains it is alive when the pair is.
+   There must be room for the header, so objects are never allocated
+   right below a pinned pair.
+
+   The callee-saved registers are spilled onto the stack before it is
+   scanned, and the stack is scanned up to the frame of 'main'.
+   Parallel and incremental collection are not available in this mode.
+*/
+
+word *mem_stack_base;
+
+val **mem_ambig;
+int mem_ambig_n = 0;
+int mem_ambig_size = 0;
+
+/* All large objects are between these two addresses.
+ */
+val *mem_large_lo = NULL, *mem_large_hi = NULL;
+
+/* The islands of the nursery and the old generation, sorted by
+   address.
+*/
+struct mem_islands {
+  struct mem_pin *pins;
+  int n;
+};
+
+struct mem_islands mem_young_islands, mem_old_islands;
+
+void mem_fill (val *ptr, word size);
+void mem_fill_pairs (val *ptr, word size);
+
+struct mem_pin *mem_young_pins;
+int mem_young_n_pins = 0;
+word *mem_young_pin_bits;
+
+bool
+mem_in_space_p (struct mem_space *s, val *ptr)
+{
+  return ((ptr >= s->first && ptr < s->next)
+	  || (ptr >= s->pairs && ptr < s->end));
+}
+
+void
+mem_add_ambig (val *ptr)
+{
+  if (!mem_young_p (ptr)
+      && !(ptr >= mem_old.first && ptr < mem_old.end)
+      && !(ptr >= mem_large_lo && ptr < mem_large_hi))
+    return;
+
+  if (mem_ambig_n == mem_ambig_size)
+    {
+      mem_ambig_size = 2*mem_ambig_size + 256;
+      mem_ambig = realloc (mem_ambig, mem_ambig_size*sizeof(val *));
+      if (mem_ambig == NULL)
+	abort ();
+    }
+
+  mem_ambig[mem_ambig_n++] = ptr;
+}
+
+/* The frame of this function is right below the one of its caller,
+   which holds the spilled registers.
+*/
+
+void __attribute__ ((noinline))
+mem_scan_stack ()
+{
+  mem_ambig_n = 0;
+  for (word *p = __builtin_frame_address (0); p < mem_stack_base; p++)
+    {
+#ifdef VAL_COMPRESSED
+      /* A word might be a compressed value, or half of a real pointer.
+       */
+      mem_add_ambig ((val *)(mem_base + *p));
+      if ((unsigned long)p % sizeof (val *) == 0)
+	mem_add_ambig (*(val **)p);
+#else
+      mem_add_ambig ((val *)(uintptr_t)*p);
+#endif
+    }
+}
+
+void __attribute__ ((noinline))
+mem_find_ambig ()
+{
+  __builtin_unwind_init ();
+  mem_scan_stack ();
+
+  /* Keep the call from becoming a jump that pops our frame first.
+   */
+  asm volatile ("" : : : "memory");
+}
+
+int
+mem_pin_compare (const void *a, const void *b)
+{
+  val *p = ((struct mem_pin *)a)->ptr, *q = ((struct mem_pin *)b)->ptr;
+  return p < q? -1 : p > q;
+}
+
+/* The island in IS that covers PTR, if any.
+ */
+
+struct mem_pin *
+mem_island_at (struct mem_islands *is, val *ptr)
+{
+  for (int i = 0; i < is->n; i++)
+    if (ptr >= is->pins[i].ptr
+	&& ptr < is->pins[i].ptr + ((is->pins[i].size + 1) & ~1))
+      return &is->pins[i];
+  return NULL;
+}
+
+bool
+mem_island_p (val *ptr)
+{
+  return mem_island_at (&mem_old_islands, ptr) != NULL;
+}
+
+/* Find the objects in S and its islands IS that the ambiguous roots
+   point into, and store them in PINS, sorted by address.  All bits in
+   BITS that are covered by a pinned object are set; BITS must be
+   clear.  Returns the number of pinned objects.
+*/
+
+int
+mem_find_pins (struct mem_space *s, struct mem_islands *is, word *bits,
+	       struct mem_pin **pins)
+{
+  word granules = (s->next - s->first) / 2;
+  word *starts = NULL;
+  int n = 0;
+
+  *pins = NULL;
+  for (int i = 0; i < mem_ambig_n; i++)
+    {
+      val *p = mem_ambig[i], *obj;
+      word size;
+      bool pair = false;
+      struct mem_pin *in;
+
+      if (!mem_in_space_p (s, p))
+	{
+	  if ((in = mem_island_at (is, p)) == NULL)
+	    continue;
+	  obj = in->ptr;
+	  size = in->size;
+	  pair = in->pair;
+	}
+      else if (mem_space_pair_p (s, p))
+	{
+	  obj = s->first + ((p - s->first) & ~1);
+	  size = 2;
+	  pair = true;
+	}
+      else
+	{
+	  if (starts == NULL)
+	    {
+	      starts = calloc ((granules + 31) / 32, sizeof (word));
+	      if (starts == NULL)
+		abort ();
+	      for (val *q = s->first; q < s->next;
+		   q = mem_align (q + mem_obj_size (q, q[0])))
+		mem_set_bits (starts, (q - s->first) / 2, 1);
+	    }
+
+	  word g = (p - s->first) / 2;
+	  while (!mem_bit (starts, g))
+	    g--;
+	  obj = s->first + 2*g;
+	  size = mem_obj_size (obj, obj[0]);
+	  if (p >= obj + size)
+	    continue;
+	}
+
+      word g = (obj - s->first) / 2;
+      if (mem_bit (bits, g))
+	continue;
+      mem_set_bits (bits, g, (size + 1) / 2);
+
+      *pins = realloc (*pins, (n + 1)*sizeof (struct mem_pin));
+      if (*pins == NULL)
+	abort ();
+      (*pins)[n].ptr = obj;
+      (*pins)[n].size = size;
+      (*pins)[n].pair = pair;
+      n++;
+    }
+
+  free (starts);
+  qsort (*pins, n, sizeof (struct mem_pin), mem_pin_compare);
+  return n;
+}
+
+/* Find the pinned young objects for the next minor collection.
+ */
+
+void
+mem_pin_young ()
+{
+  word n_words = (mem_young_size/2 + 31) / 32;
+
+  if (mem_young_pin_bits == NULL)
+    mem_young_pin_bits = malloc (n_words * sizeof (word));
+  if (mem_young_pin_bits == NULL)
+    abort ();
+  memset (mem_young_pin_bits, 0, n_words * sizeof (word));
+
+  free (mem_young_pins);
+  mem_young_n_pins = mem_find_pins (&mem_young, &mem_young_islands,
+				    mem_young_pin_bits, &mem_young_pins);
+}
+
+bool
+mem_pinned_p (val *ptr)
+{
+  return (mem_young_n_pins > 0 && mem_young_p (ptr)
+	  && mem_bit (mem_young_pin_bits, (ptr - mem_young.first) / 2));
+}
+
+/* Allocate SIZE words in the free part of S, around the islands IS,
+   and return their address, or NULL when they don't fit.  Nothing is
+   changed unless COMMIT is true.
+
+   A pinned pair in the object part is wrapped into a vector whose
+   header takes the two words below it.  A pair at the very start of S
+   would have no room for that, so no pair is allocated there.
+*/
+
+val *
+mem_hole_alloc (struct mem_space *s, struct mem_islands *is, sword size,
+		bool pair, bool commit)
+{
+  val *ptr;
+
+  if (pair)
+    {
+      struct mem_pin *in;
+
+      ptr = s->pairs - 2;
+      while ((in = mem_island_at (is, ptr)) != NULL)
+	{
+	  if (!in->pair)
+	    return NULL;
+	  ptr -= 2;
+	}
+      if (ptr < s->next || ptr == s->first)
+	return NULL;
+      if (commit)
+	s->pairs = ptr;
+      return ptr;
+    }
+
+  word room = (size+1)&~1;
+  ptr = s->next;
+  for (int i = 0; i < is->n; i++)
+    {
+      struct mem_pin *in = &is->pins[i];
+      val *q = in->ptr;
+      if (q < ptr || q >= s->pairs)
+	continue;
+
+      val *limit = in->pair? q - 2 : q;
+      if (ptr + room <= limit)
+	break;
+      if (ptr > limit)
+	return NULL;
+
+      int n = 1;
+      if (in->pair)
+	while (i + n < is->n && is->pins[i + n].pair
+	       && is->pins[i + n].ptr == q + 2*n && q + 2*n < s->pairs)
+	  n++;
+
+      if (commit)
+	{
+	  mem_fill (ptr, limit - ptr);
+	  if (in->pair)
+	    {
+	      q[-2] = head_make (2*n + 1, 6, 0x0f);
+	      q[-1] = unspec;
+	    }
+	}
+      ptr = in->pair? q + 2*n : q + ((in->size + 1) & ~1);
+      i += n - 1;
+    }
+
+  if (ptr + room > s->pairs)
+    return NULL;
+  if (commit)
+    s->next = ptr + room;
+  return ptr;
+}
+
+/* Forget the islands of S that are part of its object or pair part
+   now.
+*/
+
+void
+mem_prune_islands (struct mem_space *s, struct mem_islands *is)
+{
+  int n = 0;
+  for (int i = 0; i < is->n; i++)
+    if (is->pins[i].ptr >= s->next && is->pins[i].ptr < s->pairs)
+      is->pins[n++] = is->pins[i];
+  is->n = n;
+}
+
+/* The words taken by the islands, including their headers.
+ */
+
+word
+mem_islands_words (struct mem_islands *is)
+{
+  word n = 0;
+  for (int i = 0; i < is->n; i++)
+    n += ((is->pins[i].size + 1) & ~1) + (is->pins[i].pair? 2 : 0);
+  return n;
+}
+
+/* Keep the nursery allocation limits in front of the islands.
+ */
+
+void
+mem_hole_limits ()
+{
+  for (int i = 0; i < mem_young_islands.n; i++)
+    {
+      struct mem_pin *in = &mem_young_islands.pins[i];
+      val *lo = in->pair? in->ptr - 2 : in->ptr;
+      val *hi = in->ptr + ((in->size + 1) & ~1);
+      if (lo < mem_limit)
+	mem_limit = lo;
+      if (hi > mem_pair_limit)
+	mem_pair_limit = hi;
+    }
+
+  if (mem_pair_limit < mem_young.first + 2)
+    mem_pair_limit = mem_young.first + 2;
+}
+
+/* The vector that wraps the pair at PTR.  Headers never appear in
+   pairs, but doubles might look like one.
+*/
+
+val
+mem_wrapper (val *ptr)
+{
+  do
+    ptr -= 2;
+  while (!vec_ptr_p (ptr) || flo_p (ptr[0]));
+  return val_ptr_make (ptr, 2);
+}
+
+/* Before compacting, the islands of the old generation, which are
+   all pairs, become part of the pair part again, and the free pairs
+   between them are cleared.
+*/
+
+void
+mem_fold_islands ()
+{
+  struct mem_islands *is = &mem_old_islands;
+  if (is->n == 0)
+    return;
+
+  val *ptr = is->pins[0].ptr;
+  for (int i = 0; i < is->n; i++)
+    {
+      mem_fill_pairs (ptr, is->pins[i].ptr - ptr);
+      ptr = is->pins[i].ptr + 2;
+    }
+  mem_fill_pairs (ptr, mem_old.pairs - ptr);
+
+  mem_old.pairs = is->pins[0].ptr;
+  is->n = 0;
+}
+
+/* Return the tagged value for a pinned object.
+ */
+
+val
+mem_pin_val (struct mem_pin *pin)
+{
+  val *h = pin->ptr;
+
+  if (pin->pair)
+    return val_ptr_make (h, 1);
+  else if (vec_ptr_p (h))
+    return val_ptr_make (h, 2);
+  else if (rec_ptr_p (h))
+    return val_ptr_make (h, 3);
+  else
+    return val_ptr_make (h, 5);
+}
+
+#endif /* GC_CONSERVATIVE */
+
+struct mem_worker;
+__thread struct mem_worker *mem_worker;
+
+val *mem_copy_par (val *ptr, word head, sword size, bool pair);
+void mem_mark_large_par (val *ptr);
+
+#define MEM_PREFETCH_DISTANCE 4
+
+int mem_cdr_chain = 256;
+
+void
+mem_set_cdr_chain (char *str)
+{
+  mem_cdr_chain = atoi (str);
+  if (mem_cdr_chain < 0)
+    {
+      printf ("invalid chain length: %s\n", str);
+      exit (1);
+    }
+}
+
+void
+mem_prefetch (val v)
+{
+  if (val_ptr_p (v))
+    __builtin_prefetch (val_ptr_any_tag (v));
+}
+
+void
+mem_mark_large (val *ptr)
+{
+  struct mem_large *l = mem_large_header (ptr);
+
+  if (__atomic_exchange_n (&l->mark, 1, __ATOMIC_RELAXED))
+    return;
+
+  if (mem_worker)
+    mem_mark_large_par (ptr);
+  else
+    {
+      l->gray = mem_large_gray;
+      mem_large_gray = l;
+    }
+}
+
+/* During an incremental cycle, the objects in the from space that have
+   an identity hash are marked in this bitmap, see 'Identity hashes'.
+*/
+
+word *mem_hash_from_bits;
+void mem_hash_moved (val *old, val *new);
+
+/* Copy the object at PTR, whose first word is HEAD, to the to space,
+   and return its new address.
+*/
+
+val *
+mem_copy_obj (val *ptr, word head, sword size, bool pair)
+{
+  val *new_ptr;
+
+  if (mem_worker)
+    return mem_copy_par (ptr, head, size, pair);
+
+#ifdef GC_CONSERVATIVE
+  new_ptr = mem_hole_alloc (mem_to, &mem_old_islands, size, pair, true);
+  if (new_ptr == NULL)
+    {
+      printf ("FULL\n");
+      abort ();
+    }
+#else
+  if (pair)
+    {
+      new_ptr = mem_to->pairs - 2;
+      if (new_ptr < mem_to->next)
+	{
+	  printf ("FULL\n");
+	  abort ();
+	}
+      mem_to->pairs = new_ptr;
+    }
+  else
+    {
+      new_ptr = mem_to->next;
+      if (new_ptr + size > mem_to->pairs)
+	{
+	  printf ("FULL\n");
+	  abort ();
+	}
+      mem_to->next += (size+1)&~1;
+    }
+#endif
+
+  memcpy (new_ptr, ptr, size*sizeof(word));
+  mem_install_fwd_ptr (ptr, new_ptr);
+  mem_stats_count (&mem_stats_copied, head, size, pair);
+
+  if (mem_hash_from_bits && ptr >= mem_from.first && ptr < mem_from.end
+      && mem_bit (mem_hash_from_bits, (ptr - mem_from.first) / 2))
+    mem_hash_moved (ptr, new_ptr);
+
+  return new_ptr;
+}
+
+/* Copy the pairs in the cdr chain of the already copied pair at PTR.
+   In a parallel collection, another worker might be scanning that pair
+   at the same time, and we might find its cdr already updated.
+*/
+
+void
+mem_copy_cdrs (val *ptr)
+{
+  for (int i = 0; i < mem_cdr_chain; i++)
+    {
+      val d = __atomic_load_n (&ptr[1], __ATOMIC_RELAXED);
+      if (!pair_p (d))
+	return;
+
+      val *p = val_ptr (d, 1);
+      if (!mem_from_p (p))
+	return;
+#ifdef GC_CONSERVATIVE
+      if (mem_pinned_p (p))
+	return;
+#endif
+
+      word head = __atomic_load_n (&p[0], __ATOMIC_ACQUIRE);
+      if (mem_fwd_ptr_p (head))
+	return;
+
+      ptr = mem_copy_obj (p, head, 2, true);
+    }
+}
+
+val
+mem_copy (val v)
+{
+  val *ptr, *new_ptr;
+
+  if (!val_ptr_p (v))
+    return v;
+
+  ptr = val_ptr_any_tag (v);
+  if (!mem_from_p (ptr))
+    {
+      if (mem_marking && mem_large_p (ptr))
+	mem_mark_large (ptr);
+      return v;
+    }
+
+#ifdef GC_CONSERVATIVE
+  if (mem_pinned_p (ptr))
+    return v;
+#endif
+
+  /* If we find a forwarding pointer, we just follow it.
+   */
+  word head = __atomic_load_n (&ptr[0], __ATOMIC_ACQUIRE);
+  if (mem_fwd_ptr_p (head))
+    return val_ptr_make (val_ptr (head, 1), val_tag (v, 3));
+
+  if (pair_p (v))
+    {
+      new_ptr = mem_copy_obj (ptr, head, 2, true);
+      mem_copy_cdrs (new_ptr);
+    }
+  else
+    new_ptr = mem_copy_obj (ptr, head, mem_obj_size (ptr, head), false);
+
+  return val_ptr_make (new_ptr, val_tag (v, 3));
+}
+
+/* Most fields of most objects hold small integers or other values that
+   aren't pointers.  Instead of looking at every field on its own,
+   'scan' checks the tags of MEM_SCAN_BLOCK fields at a time with vector
+   operations, which GCC turns into SSE or AVX2 instructions where it
+   can, and into plain loops elsewhere.  Only the blocks that contain a
+   pointer are scanned field by field.  This can be turned off with the
+   --gc-scan-blocks=0 option or SUO_GC_SCAN_BLOCKS, to compare.
+*/
+
+#define MEM_SCAN_LANES (16/sizeof (word))
+#define MEM_SCAN_BLOCK 8
+
+typedef word mem_lanes __attribute__ ((vector_size (16)));
+
+bool mem_scan_blocks = true;
+
+void
+mem_set_scan_blocks (char *str)
+{
+  mem_scan_blocks = atoi (str) != 0;
+}
+
+bool
+mem_block_ptrs_p (val *ptr)
+{
+  mem_lanes m = { 0 };
+  for (int i = 0; i < MEM_SCAN_BLOCK; i += MEM_SCAN_LANES)
+    {
+      mem_lanes b;
+      memcpy (&b, ptr + i, sizeof (b));
+      mem_lanes tags = b & 7;
+      mem_lanes p = (mem_lanes)((tags & 3) != 0) & (mem_lanes)(tags != 7);
+#ifdef VAL_NAN
+      p &= (mem_lanes)((b >> VAL_NAN_BITS) == 0);
+#endif
+      m |= p;
+    }
+
+  word any[2];
+  memcpy (any, &m, sizeof (any));
+  for (int i = 2; i < MEM_SCAN_LANES; i += 2)
+    {
+      any[0] |= m[i];
+      any[1] |= m[i+1];
+    }
+  return (any[0] | any[1]) != 0;
+}
+
+void
+mem_scan_fields (val *ptr, int size)
+{
+  for (int i = 0; i < size; i++)
+    {
+      if (i + MEM_PREFETCH_DISTANCE < size)
+	mem_prefetch (ptr[i + MEM_PREFETCH_DISTANCE]);
+      ptr[i] = mem_copy (ptr[i]);
+#ifdef GC_CONSERVATIVE
+      if (mem_young_n_pins > 0)
+	mem_write_barrier (&ptr[i], ptr[i]);
+#endif
+    }
+}
+
+void mem_weak_add (val *ptr);
+
+val *
+mem_scan (val *ptr)
+{
+  sword size;
+
+  if (vec_ptr_p (ptr))
+    {
+      if (flat_ptr_p (ptr))
+	return mem_align (ptr + vec_ptr_len (ptr) + 1);
+      if (weak_ptr_p (ptr) || eph_ptr_p (ptr))
+	{
+	  mem_weak_add (ptr);
+	  return mem_align (ptr + vec_ptr_len (ptr) + 1);
+	}
+      size = vec_ptr_len (ptr);
+      ptr += 1;
+    }
+  else if (bytev_ptr_p (ptr))
+    {
+      ptr += word_count (bytev_ptr_len (ptr)) + 1;
+      size = 0;
+    }
+  else if (code_ptr_p (ptr))
+    {
+      int b = code_ptr_lit_begin (ptr);
+      int e = code_ptr_lit_end (ptr);
+      size = e - b;
+      ptr += b;
+    }
+  else if (rec_ptr_p (ptr))
+    {
+      /* We need to copy the descriptor here manually, since it has a
+	 funny tag that the rest of the code doesn't want to see.
+      */
+      val desc = mem_copy (rec_ptr_desc (ptr));
+      ptr[0] = rec_header_make (desc);
+#ifdef GC_CONSERVATIVE
+      if (mem_young_n_pins > 0)
+	mem_write_barrier (&ptr[0], ptr[0]);
+#endif
+      size = fixnum_num (rec_ptr(desc)[0]);
+      ptr += 1;
+      if (size < 0)
+	{
+	  ptr += size;
+	  size = 0;
+	}
+    }
+  else
+    abort ();
+
+  int i = 0;
+  if (mem_scan_blocks)
+    for (; i + MEM_SCAN_BLOCK <= size; i += MEM_SCAN_BLOCK)
+      if (mem_block_ptrs_p (ptr + i))
+	mem_scan_fields (ptr + i, MEM_SCAN_BLOCK);
+  mem_scan_fields (ptr + i, size - i);
+
+  return mem_align (ptr + size);
+}
+
+void
+mem_scan_pair (val *ptr)
+{
+  ptr[0] = mem_copy (ptr[0]);
+  ptr[1] = mem_copy (ptr[1]);
+#ifdef GC_CONSERVATIVE
+  if (mem_young_n_pins > 0)
+    {
+      mem_write_barrier (&ptr[0], ptr[0]);
+      mem_write_barrier (&ptr[1], ptr[1]);
+    }
+#endif
+}
+
+/* Pairs are scanned downwards, so the next one is right below.
+ */
+
+void
+mem_prefetch_pair (val *ptr, struct mem_space *s)
+{
+  if (ptr - 2 >= s->pairs)
+    {
+      mem_prefetch (ptr[-2]);
+      mem_prefetch (ptr[-1]);
+    }
+}
+
+/* Scan the next large object on the gray list.
+ */
+
+void
+mem_scan_large ()
+{
+  struct mem_large *l = mem_large_gray;
+  mem_large_gray = l->gray;
+  mem_scan (l->obj);
+}
+
+/* Weak references
+
+   Weak vectors and ephemeron vectors don't keep alive what they refer
+   to.  When 'scan' finds one, it leaves its fields alone and puts it
+   on the 'weak' list instead.  Once everything else has been scanned,
+   the value of each pair in an ephemeron vector on that list whose
+   key has survived is copied, and scanned.  That might let more keys
+   survive, and find more weak objects, so this is repeated until
+   nothing changes.  Then each field of a weak vector that refers to a
+   dead object is set to #f, as are both fields of each pair of an
+   ephemeron vector whose key is dead.  The other fields are updated
+   to the new places of their objects.
+
+   Only the weak objects that a collection scans are treated like
+   this.  A minor collection follows the remembered fields of old
+   objects like all other roots, so a weak field in the old generation
+   lets go of a young object only in a major collection.  During an
+   incremental cycle, the list fills up as the new old generation is
+   scanned, and is processed at the end of the cycle.  The read
+   barrier copies everything that the program loads from a weak field
+   during the cycle, so that survives.  Minor collections during the
+   cycle only process the part of the list that they have added
+   themselves.  The mark-compact collector uses the list in the same
+   way, with its mark bits instead of forwarding pointers.
+
+   Parallel workers add to the list under a lock.  The ephemerons are
+   processed by the main thread alone, after the workers are done.
+
+   With conservative roots, a stale word on the stack can keep an
+   object alive that is otherwise only referred to weakly.
+*/
+
+val **mem_weak_objs;
+int mem_weak_n = 0;
+int mem_weak_size = 0;
+pthread_mutex_t mem_weak_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void
+mem_weak_add (val *ptr)
+{
+  if (mem_worker)
+    pthread_mutex_lock (&mem_weak_lock);
+
+  if (mem_weak_n == mem_weak_size)
+    {
+      mem_weak_size = 2*mem_weak_size + 256;
+      mem_weak_objs = realloc (mem_weak_objs, mem_weak_size*sizeof(val *));
+      if (mem_weak_objs == NULL)
+	abort ();
+    }
+
+  mem_weak_objs[mem_weak_n++] = ptr;
+
+  if (mem_worker)
+    pthread_mutex_unlock (&mem_weak_lock);
+}
+
+/* Return whether the object that SLOT refers to has survived the
+   current copying collection so far, and update SLOT if the object
+   has been copied.
+*/
+
+bool
+mem_weak_alive (val *slot)
+{
+  val v = *slot;
+  if (!val_ptr_p (v))
+    return true;
+
+  val *ptr = val_ptr_any_tag (v);
+  if (!mem_from_p (ptr))
+    {
+      if (mem_marking && mem_large_p (ptr))
+	return mem_large_header (ptr)->mark;
+      return true;
+    }
+
+#ifdef GC_CONSERVATIVE
+  if (mem_pinned_p (ptr))
+    return true;
+#endif
+
+  word head = ptr[0];
+  if (!mem_fwd_ptr_p (head))
+    return false;
+
+  *slot = val_ptr_make (val_ptr (head, 1), val_tag (v, 3));
+  return true;
+}
+
+/* Scan the to space from SCAN and PAIR_SCAN until there is nothing
+   left to scan.
+*/
+
+void
+mem_scan_to (val **scan, val **pair_scan)
+{
+  while (*scan < mem_to->next || *pair_scan > mem_to->pairs
+	 || mem_large_gray)
+    {
+      if (*scan < mem_to->next)
+	*scan = mem_scan (*scan);
+      else if (*pair_scan > mem_to->pairs)
+	mem_scan_pair (*pair_scan -= 2);
+      else
+	mem_scan_large ();
+    }
+}
+
+/* Copy the values of the ephemerons from BASE on whose keys have
+   survived, and everything they lead to.
+*/
+
+void
+mem_weak_trace (int base, val **scan, val **pair_scan)
+{
+  bool more = true;
+
+  while (more)
+    {
+      for (int i = base; i < mem_weak_n; i++)
+	{
+	  val *ptr = mem_weak_objs[i];
+	  if (eph_ptr_p (ptr))
+	    for (word j = 1; j < vec_ptr_len (ptr); j += 2)
+	      if (mem_weak_alive (&ptr[j]))
+		ptr[j+1] = mem_copy (ptr[j+1]);
+	}
+
+      more = (*scan < mem_to->next || *pair_scan > mem_to->pairs
+	      || mem_large_gray);
+      mem_scan_to (scan, pair_scan);
+    }
+}
+
+/* Clear the fields of the weak objects from BASE on that refer to
+   dead objects, according to ALIVE, and take them off the list.
+*/
+
+void
+mem_weak_clear (int base, bool (*alive) (val *slot))
+{
+  for (int i = base; i < mem_weak_n; i++)
+    {
+      val *ptr = mem_weak_objs[i];
+      word len = vec_ptr_len (ptr);
+
+      if (eph_ptr_p (ptr))
+	{
+	  for (word j = 1; j < len; j += 2)
+	    if (!alive (&ptr[j]))
+	      ptr[j] = ptr[j+1] = bool_f;
+	}
+      else
+	{
+	  for (word j = 1; j <= len; j++)
+	    if (!alive (&ptr[j]))
+	      ptr[j] = bool_f;
+	}
+
+#ifdef GC_CONSERVATIVE
+      if (mem_young_n_pins > 0)
+	for (word j = 1; j <= len; j++)
+	  mem_write_barrier (&ptr[j], ptr[j]);
+#endif
+    }
+
+  mem_weak_n = base;
+}
+
+/* Identity hashes
+
+   Objects move during collections, so their addresses can't be used
+   as hash codes.  Instead, 'mem_hash' gives an object a number from a
+   counter the first time it is asked for one, and remembers it in a
+   side table, which is an open addressing hash table of entries keyed
+   by the current addresses of their objects.  Values that aren't in
+   the heap are hashed by their bits.  Hashes are small integers that
+   stay the same for the whole life of their object, and are kept in
+   heap images.  Thus, tables that use them never need to be rehashed.
+
+   The side table refers to its objects weakly.  After a collection,
+   its entries are updated like weak fields, see 'Weak references'.
+   Only the side table itself is rehashed, and only when one of its
+   objects has moved or died.  Minor collections skip it completely
+   when none of its objects is young.  The mark-compact collector uses
+   its mark bits and new addresses.
+
+   During an incremental cycle, the program might ask for the hash of
+   an object that has been copied since the cycle started, and the
+   side table must know about its new address right away.  The
+   objects in the from space that have a hash are thus marked in
+   'mem_hash_from_bits' when the cycle starts, and 'copy' moves their
+   entries along with them.
+*/
+
+#define MEM_HASH_MASK 0x1fffffff
+
+struct mem_hash_entry {
+  val obj;
+  word hash;
+};
+
+struct mem_hash_entry *mem_hashes;
+int mem_hash_n = 0;
+int mem_hash_size = 0;
+int mem_hash_young = 0;
+word mem_hash_counter = 0;
+
+/* The index has a power of two of slots, at least twice as many as
+   there are entries.  A slot holds the number of an entry plus one,
+   or zero when it is free.
+*/
+
+int *mem_hash_index;
+word mem_hash_index_size = 0;
+
+/* Multiply with 2^N divided by the golden ratio, and fold the high
+   half, which depends on all bits of X, into the low half, which the
+   index uses.
+*/
+
+word
+mem_hash_mix (word x)
+{
+#ifdef VAL_64
+  x *= 0x9e3779b97f4a7c15;
+  return x ^ x >> 32;
+#else
+  x *= 0x9e3779b9;
+  return x ^ x >> 16;
+#endif
+}
+
+word
+mem_hash_home (val *ptr)
+{
+  return (mem_hash_mix (val_ptr_make (ptr, 0) >> 3)
+	  & (mem_hash_index_size - 1));
+}
+
+void
+mem_hash_insert (int i)
+{
+  word j = mem_hash_home (val_ptr_any_tag (mem_hashes[i].obj));
+  while (mem_hash_index[j])
+    j = (j + 1) & (mem_hash_index_size - 1);
+  mem_hash_index[j] = i + 1;
+}
+
+void
+mem_hash_rebuild ()
+{
+  word size = 64;
+  while (size < 2*(word)mem_hash_n + 2)
+    size *= 2;
+
+  if (size != mem_hash_index_size)
+    {
+      free (mem_hash_index);
+      mem_hash_index = malloc (size * sizeof (int));
+      if (mem_hash_index == NULL)
+	abort ();
+      mem_hash_index_size = size;
+    }
+
+  memset (mem_hash_index, 0, size * sizeof (int));
+  for (int i = 0; i < mem_hash_n; i++)
+    mem_hash_insert (i);
+}
+
+/* The slot of the index that refers to the object at PTR, or -1.
+ */
+
+sword
+mem_hash_find (val *ptr)
+{
+  if (mem_hash_index_size == 0)
+    return -1;
+
+  word j = mem_hash_home (ptr);
+  while (mem_hash_index[j])
+    {
+      if (val_ptr_any_tag (mem_hashes[mem_hash_index[j] - 1].obj) == ptr)
+	return j;
+      j = (j + 1) & (mem_hash_index_size - 1);
+    }
+  return -1;
+}
+
+/* Free slot J of the index, and move the slots after it back into
+   the gap when that brings them closer to their home.
+*/
+
+void
+mem_hash_unindex (word j)
+{
+  word mask = mem_hash_index_size - 1;
+  word k = j;
+
+  while (1)
+    {
+      k = (k + 1) & mask;
+      if (mem_hash_index[k] == 0)
+	break;
+
+      word home = mem_hash_home (val_ptr_any_tag
+				 (mem_hashes[mem_hash_index[k] - 1].obj));
+      if (((k - home) & mask) >= ((k - j) & mask))
+	{
+	  mem_hash_index[j] = mem_hash_index[k];
+	  j = k;
+	}
+    }
+
+  mem_hash_index[j] = 0;
+}
+
+word
+mem_hash (val v)
+{
+  if (!val_ptr_p (v))
+    return (mem_hash_mix (v) >> 3) & MEM_HASH_MASK;
+
+  val *ptr = val_ptr_any_tag (v);
+  sword j = mem_hash_find (ptr);
+  if (j >= 0)
+    return mem_hashes[mem_hash_index[j] - 1].hash;
+
+  if (mem_hash_n == mem_hash_size)
+    {
+      mem_hash_size = 2*mem_hash_size + 256;
+      mem_hashes = realloc (mem_hashes,
+			    mem_hash_size*sizeof(struct mem_hash_entry));
+      if (mem_hashes == NULL)
+	abort ();
+    }
+
+  int i = mem_hash_n++;
+  mem_hashes[i].obj = v;
+  mem_hashes[i].hash = ((mem_hash_mix (++mem_hash_counter) >> 3)
+			& MEM_HASH_MASK);
+  if (mem_young_p (ptr))
+    mem_hash_young++;
+
+  if (2*(word)mem_hash_n + 2 > mem_hash_index_size)
+    mem_hash_rebuild ();
+  else
+    mem_hash_insert (i);
+
+  return mem_hashes[i].hash;
+}
+
+/* Move the entry of the object at OLD to NEW.
+ */
+
+void
+mem_hash_moved (val *old, val *new)
+{
+  sword j = mem_hash_find (old);
+  if (j < 0)
+    abort ();
+
+  int i = mem_hash_index[j] - 1;
+  mem_hash_unindex (j);
+  mem_hashes[i].obj = val_ptr_make (new, val_tag (mem_hashes[i].obj, 3));
+  mem_hash_insert (i);
+}
+
+/* Drop the entries of dead objects according to ALIVE, which also
+   updates the addresses of the others, and rehash when anything has
+   changed.
+*/
+
+void
+mem_hash_sweep (bool (*alive) (val *slot))
+{
+  bool changed = false;
+  int n = 0;
+
+  mem_hash_young = 0;
+  for (int i = 0; i < mem_hash_n; i++)
+    {
+      val old = mem_hashes[i].obj;
+      if (!alive (&mem_hashes[i].obj))
+	{
+	  changed = true;
+	  continue;
+	}
+      if (mem_hashes[i].obj != old)
+	changed = true;
+      if (mem_young_p (val_ptr_any_tag (mem_hashes[i].obj)))
+	mem_hash_young++;
+      mem_hashes[n++] = mem_hashes[i];
+    }
+  mem_hash_n = n;
+
+  if (changed)
+    mem_hash_rebuild ();
+}
+
+/* Mark the objects in the from space that have a hash, when a cycle
+   starts.
+*/
+
+void
+mem_hash_mark_from ()
+{
+  word *bits = NULL;
+
+  for (int i = 0; i < mem_hash_n; i++)
+    {
+      val *ptr = val_ptr_any_tag (mem_hashes[i].obj);
+      if (ptr >= mem_from.first && ptr < mem_from.end)
+	{
+	  if (bits == NULL)
+	    {
+	      word n = (mem_from.end - mem_from.first) / 2;
+	      bits = calloc (n / 32 + 1, sizeof (word));
+	      if (bits == NULL)
+		abort ();
+	    }
+	  mem_set_bits (bits, (ptr - mem_from.first) / 2, 1);
+	}
+    }
+
+  mem_hash_from_bits = bits;
+}
+
+void debug_write (val x);
+void mem_check ();
+
+/* Parallel collection
+
+   With more than one collector thread, the roots are divided among
+   all threads, and each of them copies and scans objects
+   independently.  The main thread takes part as the first worker, the
+   others wait in a pool until they are needed.
+
+   Instead of copying directly to the end of the new region, each
+   worker reserves a 'chunk' of it for itself, and copies objects into
+   that.  Thus, the workers only need to synchronize when they need a
+   new chunk.  When two workers try to copy the same object at the same
+   time, both copy it into their own chunks, but only one of them
+   succeeds in installing its forwarding pointer with an atomic
+   compare-and-swap.  The other one takes back its copy and uses the
+   winner's.  Unused space at the end of a chunk, and copies that
+   can't be taken back, are turned into byte vectors so that the
+   region can still be scanned from start to finish.  Pairs are copied
+   into separate chunks at the end of the new region, and unused pairs
+   are cleared.  Chunks are reserved from both ends of the free part of
+   the new region, so this needs a lock.
+
+   Copied objects are not found by a single scan pointer anymore.
+   Instead, each worker pushes the objects that it has copied onto its
+   own double ended queue, and scans the objects that it pops from it.
+   When a worker runs out of work, it steals objects from the other end
+   of the queue of another worker.  The collection is finished when all
+   workers are out of work at the same time.
+
+   The queues are the lock free ones described by Chase and Lev in
+   "Dynamic Circular Work-Stealing Deque".
+
+   The number of threads is set with the --gc-threads command line
+   option, or the SUO_GC_THREADS environment variable.  The default is
+   to collect in the main thread only.
+ */
+
+#define MEM_MAX_WORKERS 64
+#define MEM_CHUNK_SIZE  1024
+
+int mem_gc_threads = 1;
+
+void
+mem_set_gc_threads (char *str)
+{
+  mem_gc_threads = atoi (str);
+  if (mem_gc_threads < 1 || mem_gc_threads > MEM_MAX_WORKERS)
+    {
+      printf ("invalid number of threads: %s\n", str);
+      exit (1);
+    }
+#ifdef GC_CONSERVATIVE
+  if (mem_gc_threads > 1)
+    {
+      printf ("parallel collection needs precise roots\n");
+      exit (1);
+    }
+#endif
+}
+
+struct mem_deque_buf {
+  long size;
+  struct mem_deque_buf *prev;
+  val *objs[];
+};
+
+struct mem_deque {
+  long top, bottom;
+  struct mem_deque_buf *buf;
+};
+
+struct mem_deque_buf *
+mem_deque_buf_make (long size, struct mem_deque_buf *prev)
+{
+  struct mem_deque_buf *b = malloc (sizeof (*b) + size*sizeof(val *));
+  if (b == NULL)
+    abort ();
+  b->size = size;
+  b->prev = prev;
+  return b;
+}
+
+/* Old buffers are kept around until the collection is over, since
+   thieves might still be reading from them.
+*/
+
+void
+mem_deque_grow (struct mem_deque *d, long top, long bottom)
+{
+  struct mem_deque_buf *old = d->buf;
+  struct mem_deque_buf *new = mem_deque_buf_make (2*old->size, old);
+
+  for (long i = top; i < bottom; i++)
+    new->objs[i & (new->size-1)] = old->objs[i & (old->size-1)];
+
+  __atomic_store_n (&d->buf, new, __ATOMIC_RELEASE);
+}
+
+void
+mem_deque_push (struct mem_deque *d, val *obj)
+{
+  long b = __atomic_load_n (&d->bottom, __ATOMIC_RELAXED);
+  long t = __atomic_load_n (&d->top, __ATOMIC_ACQUIRE);
+
+  if (b - t >= d->buf->size - 1)
+    mem_deque_grow (d, t, b);
+
+  d->buf->objs[b & (d->buf->size-1)] = obj;
+  __atomic_store_n (&d->bottom, b+1, __ATOMIC_RELEASE);
+}
+
+val *
+mem_deque_pop (struct mem_deque *d)
+{
+  long b = __atomic_load_n (&d->bottom, __ATOMIC_RELAXED) - 1;
+  __atomic_store_n (&d->bottom, b, __ATOMIC_SEQ_CST);
+  long t = __atomic_load_n (&d->top, __ATOMIC_SEQ_CST);
+
+  if (t > b)
+    {
+      __atomic_store_n (&d->bottom, b+1, __ATOMIC_RELAXED);
+      return NULL;
+    }
+
+  val *obj = d->buf->objs[b & (d->buf->size-1)];
+  if (t == b)
+    {
+      /* The last object; race against the thieves for it.
+       */
+      if (!__atomic_compare_exchange_n (&d->top, &t, t+1, false,
+					__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+	obj = NULL;
+      __atomic_store_n (&d->bottom, b+1, __ATOMIC_RELAXED);
+    }
+  return obj;
+}
+
+val *
+mem_deque_steal (struct mem_deque *d)
+{
+  long t = __atomic_load_n (&d->top, __ATOMIC_ACQUIRE);
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+  long b = __atomic_load_n (&d->bottom, __ATOMIC_ACQUIRE);
+
+  if (t >= b)
+    return NULL;
+
+  struct mem_deque_buf *buf = __atomic_load_n (&d->buf, __ATOMIC_ACQUIRE);
+  val *obj = buf->objs[t & (buf->size-1)];
+  if (!__atomic_compare_exchange_n (&d->top, &t, t+1, false,
+				    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    return NULL;
+  return obj;
+}
+
+bool
+mem_deque_empty_p (struct mem_deque *d)
+{
+  return (__atomic_load_n (&d->top, __ATOMIC_ACQUIRE)
+	  >= __atomic_load_n (&d->bottom, __ATOMIC_ACQUIRE));
+}
+
+struct mem_worker {
+  int id;
+  pthread_t thread;
+  val *chunk_next, *chunk_end;
+  val *pair_chunk_next, *pair_chunk_end;
+  struct mem_deque deque;
+  unsigned int seed;
+  int count;
+  struct mem_copy_stats copied;
+};
+
+struct mem_worker mem_workers[MEM_MAX_WORKERS];
+
+/* Turn SIZE words at PTR into a byte vector that nobody refers to.
+ */
+
+void
+mem_fill (val *ptr, word size)
+{
+  if (size > 0)
+    ptr[0] = head_make ((size-1)*sizeof (val), 6, 7);
+}
+
+void
+mem_fill_pairs (val *ptr, word size)
+{
+  if (size > 0)
+    memset (ptr, 0, size*sizeof(val));
+}
+
+/* Reserve SIZE words of the new region for objects or for pairs.
+*/
+
+pthread_mutex_t mem_reserve_lock = PTHREAD_MUTEX_INITIALIZER;
+
+val *
+mem_reserve_par (word size, bool pair)
+{
+  val *ptr;
+
+  pthread_mutex_lock (&mem_reserve_lock);
+  if (mem_to->next + size > mem_to->pairs)
+    {
+      printf ("FULL\n");
+      abort ();
+    }
+  if (pair)
+    ptr = mem_to->pairs -= size;
+  else
+    {
+      ptr = mem_to->next;
+      mem_to->next += size;
+    }
+  pthread_mutex_unlock (&mem_reserve_lock);
+
+  return ptr;
+}
+
+word
+mem_chunk_size (word size)
+{
+  if (mem_to->pairs - mem_to->next < MEM_CHUNK_SIZE)
+    return size;
+  return MEM_CHUNK_SIZE;
+}
+
+val *
+mem_alloc_par (struct mem_worker *w, word size)
+{
+  size = (size+1)&~1;
+
+  if (w->chunk_next + size > w->chunk_end)
+    {
+      if (size > MEM_CHUNK_SIZE/4)
+	return mem_reserve_par (size, false);
+
+      mem_fill (w->chunk_next, w->chunk_end - w->chunk_next);
+
+      word chunk = mem_chunk_size (size);
+      w->chunk_next = mem_reserve_par (chunk, false);
+      w->chunk_end = w->chunk_next + chunk;
+    }
+
+  val *ptr = w->chunk_next;
+  w->chunk_next += size;
+  return ptr;
+}
+
+/* Pair chunks are filled downwards, like the pair region itself.
+ */
+
+val *
+mem_alloc_pair_par (struct mem_worker *w)
+{
+  if (w->pair_chunk_next - w->pair_chunk_end < 2)
+    {
+      mem_fill_pairs (w->pair_chunk_end,
+		      w->pair_chunk_next - w->pair_chunk_end);
+
+      word chunk = mem_chunk_size (2);
+      w->pair_chunk_end = mem_reserve_par (chunk, true);
+      w->pair_chunk_next = w->pair_chunk_end + chunk;
+    }
+
+  w->pair_chunk_next -= 2;
+  return w->pair_chunk_next;
+}
+
+void
+mem_unalloc_par (struct mem_worker *w, val *ptr, word size, bool pair)
+{
+  size = (size+1)&~1;
+
+  if (pair && ptr == w->pair_chunk_next)
+    w->pair_chunk_next += 2;
+  else if (pair)
+    mem_fill_pairs (ptr, 2);
+  else if (ptr + size == w->chunk_next)
+    w->chunk_next = ptr;
+  else
+    mem_fill (ptr, size);
+}
+
+val *
+mem_copy_par (val *ptr, word head, sword size, bool pair)
+{
+  struct mem_worker *w = mem_worker;
+  val *new_ptr = pair? mem_alloc_pair_par (w) : mem_alloc_par (w, size);
+
+  new_ptr[0] = head;
+  memcpy (new_ptr + 1, ptr + 1, (size-1)*sizeof(word));
+
+  if (__atomic_compare_exchange_n (&ptr[0], &head, val_ptr_make (new_ptr, 1),
+				   false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+      mem_deque_push (&w->deque, new_ptr);
+      w->count++;
+      mem_stats_count (&w->copied, head, size, pair);
+      return new_ptr;
+    }
+
+  /* Someone else was faster, and HEAD now holds its forwarding
+     pointer.
+  */
+  mem_unalloc_par (w, new_ptr, size, pair);
+  return val_ptr (head, 1);
+}
+
+void
+mem_mark_large_par (val *ptr)
+{
+  mem_deque_push (&mem_worker->deque, ptr);
+  mem_worker->count++;
+}
+
+int mem_par_idle;
+
+val *
+mem_find_work (struct mem_worker *w)
+{
+  val *obj = mem_deque_pop (&w->deque);
+  if (obj)
+    return obj;
+
+  for (int i = 0; i < 2*mem_gc_threads; i++)
+    {
+      struct mem_worker *victim = &mem_workers[rand_r (&w->seed)
+					       % mem_gc_threads];
+      if (victim != w && (obj = mem_deque_steal (&victim->deque)))
+	return obj;
+    }
+
+  return NULL;
+}
+
+bool
+mem_any_work_p ()
+{
+  for (int i = 0; i < mem_gc_threads; i++)
+    if (!mem_deque_empty_p (&mem_workers[i].deque))
+      return true;
+  return false;
+}
+
+void
+mem_work_par (struct mem_worker *w)
+{
+  int n = mem_gc_threads;
+
+  mem_worker = w;
+  w->chunk_next = w->chunk_end = NULL;
+  w->pair_chunk_next = w->pair_chunk_end = NULL;
+  w->count = 0;
+
+  for (int i = w->id; i < mem_n_roots; i += n)
+    *(mem_roots[i]) = mem_copy (*(mem_roots[i]));
+  for (int i = w->id; i < mem_perm_n; i += n)
+    *(mem_perm_slots[i]) = mem_copy (*(mem_perm_slots[i]));
+
+  if (!mem_marking)
+    for (int i = w->id; i < mem_remset_n; i += n)
+      *(mem_remset[i]) = mem_copy (*(mem_remset[i]));
+
+  while (true)
+    {
+      val *obj = mem_find_work (w);
+      if (obj)
+	{
+	  /* The pairs of the new region only ever grow downwards.
+	   */
+	  if (obj >= __atomic_load_n (&mem_to->pairs, __ATOMIC_RELAXED)
+	      && obj < mem_to->end)
+	    mem_scan_pair (obj);
+	  else
+	    mem_scan (obj);
+	  continue;
+	}
+
+      /* Nobody can create new work while being idle, so when all
+	 workers are idle, we are done.
+      */
+      __atomic_add_fetch (&mem_par_idle, 1, __ATOMIC_SEQ_CST);
+      while (true)
+	{
+	  if (__atomic_load_n (&mem_par_idle, __ATOMIC_SEQ_CST) == n)
+	    goto done;
+	  if (mem_any_work_p ())
+	    {
+	      __atomic_sub_fetch (&mem_par_idle, 1, __ATOMIC_SEQ_CST);
+	      break;
+	    }
+	  sched_yield ();
+	}
+    }
+
+ done:
+  mem_fill (w->chunk_next, w->chunk_end - w->chunk_next);
+  mem_fill_pairs (w->pair_chunk_end, w->pair_chunk_next - w->pair_chunk_end);
+  mem_worker = NULL;
+}
+
+pthread_mutex_t mem_par_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t mem_par_start = PTHREAD_COND_INITIALIZER;
+pthread_cond_t mem_par_done = PTHREAD_COND_INITIALIZER;
+int mem_par_generation = 0;
+int mem_par_running = 0;
+int mem_par_threads_started = 1;
+
+void *
+mem_par_thread (void *arg)
+{
+  struct mem_worker *w = arg;
+  int generation = 0;
+
+  while (true)
+    {
+      pthread_mutex_lock (&mem_par_lock);
+      while (mem_par_generation == generation)
+	pthread_cond_wait (&mem_par_start, &mem_par_lock);
+      generation = mem_par_generation;
+      pthread_mutex_unlock (&mem_par_lock);
+
+      mem_work_par (w);
+
+      pthread_mutex_lock (&mem_par_lock);
+      if (--mem_par_running == 0)
+	pthread_cond_signal (&mem_par_done);
+      pthread_mutex_unlock (&mem_par_lock);
+    }
+  return NULL;
+}
+
+int
+mem_collect_par ()
+{
+  for (int i = 0; i < mem_gc_threads; i++)
+    {
+      struct mem_worker *w = &mem_workers[i];
+      if (w->deque.buf == NULL)
+	{
+	  w->id = i;
+	  w->seed = i + 1;
+	  w->deque.buf = mem_deque_buf_make (1024, NULL);
+	}
+      w->deque.top = w->deque.bottom = 0;
+    }
+
+  pthread_mutex_lock (&mem_par_lock);
+  for (; mem_par_threads_started < mem_gc_threads; mem_par_threads_started++)
+    {
+      struct mem_worker *w = &mem_workers[mem_par_threads_started];
+      if (pthread_create (&w->thread, NULL, mem_par_thread, w) != 0)
+	abort ();
+    }
+  mem_par_idle = 0;
+  mem_par_running = mem_gc_threads - 1;
+  mem_par_generation++;
+  pthread_cond_broadcast (&mem_par_start);
+  pthread_mutex_unlock (&mem_par_lock);
+
+  mem_work_par (&mem_workers[0]);
+
+  pthread_mutex_lock (&mem_par_lock);
+  while (mem_par_running > 0)
+    pthread_cond_wait (&mem_par_done, &mem_par_lock);
+  pthread_mutex_unlock (&mem_par_lock);
+
+  int count = 0;
+  for (int i = 0; i < mem_gc_threads; i++)
+    {
+      struct mem_deque_buf *b = mem_workers[i].deque.buf;
+      while (b->prev)
+	{
+	  struct mem_deque_buf *prev = b->prev;
+	  b->prev = prev->prev;
+	  free (prev);
+	}
+      count += mem_workers[i].count;
+      mem_stats_add (&mem_stats_copied, &mem_workers[i].copied);
+      memset (&mem_workers[i].copied, 0, sizeof (struct mem_copy_stats));
+    }
+
+  return count;
+}
+
+/* Sweeping the large object space moves the unmarked objects to the
+   'dead' list.  They can only be freed after the next collection,
+   since the remembered set might still contain locations inside them.
+*/
+
+void
+mem_sweep_large ()
+{
+  struct mem_large **lp = &mem_large_objs;
+
+  mem_large_words = 0;
+  while (*lp)
+    {
+      struct mem_large *l = *lp;
+      if (l->mark)
+	{
+	  l->mark = 0;
+	  mem_large_words += l->size;
+	  lp = &l->next;
+	}
+      else
+	{
+	  *lp = l->next;
+	  l->next = mem_large_dead;
+	  mem_large_dead = l;
+	}
+    }
+
+  mem_large_limit = mem_large_words / mem_target_live_ratio;
+  if (mem_large_limit < mem_min_size)
+    mem_large_limit = mem_min_size;
+}
+
+void
+mem_free_dead_large ()
+{
+  while (mem_large_dead)
+    {
+      struct mem_large *l = mem_large_dead;
+      mem_large_dead = l->next;
+      mem_large_mfree (l, mem_large_bytes (l->size));
+    }
+}
+
+#ifdef GC_CONSERVATIVE
+
+/* Empty the nursery after a minor collection, except for the pinned
+   objects, which become its islands.  The remembered locations that
+   still point to a pinned object are kept, as are the ones that have
+   been remembered during the collection; REMEMBERED is the number of
+   the others.
+*/
+
+void
+mem_keep_pins (int remembered)
+{
+  int n = 0;
+  for (int i = 0; i < mem_remset_n; i++)
+    {
+      val v = *(mem_remset[i]);
+      if (i >= remembered
+	  || (val_ptr_p (v) && mem_young_p (val_ptr_any_tag (v))))
+	mem_remset[n++] = mem_remset[i];
+    }
+  mem_remset_n = n;
+
+  free (mem_young_islands.pins);
+  mem_young_islands.pins = mem_young_pins;
+  mem_young_islands.n = mem_young_n_pins;
+  mem_young_pins = NULL;
+  mem_young_n_pins = 0;
+
+  mem_young.next = mem_young.first;
+  mem_young.pairs = mem_young.end;
+
+  mem_prune_islands (&mem_new, &mem_old_islands);
+}
+
+#endif
+
+/* Copy everything that is reachable from the roots, and from the
+   remembered set, into the new region.
+*/
+
+int
+mem_collect ()
+{
+  int count = 0;
+  int weak = mem_weak_n;
+#ifdef GC_CONSERVATIVE
+  int remembered = mem_remset_n;
+#endif
+
+  if (mem_gc_threads > 1)
+    count = mem_collect_par ();
+  else
+    {
+      for (int i = 0; i < mem_n_roots; i++)
+	*(mem_roots[i]) = mem_copy (*(mem_roots[i]));
+      for (int i = 0; i < mem_perm_n; i++)
+	*(mem_perm_slots[i]) = mem_copy (*(mem_perm_slots[i]));
+
+      /* A major collection scans all living objects anyway, and must
+	 not treat weak fields as roots.
+      */
+      if (!mem_marking)
+	for (int i = 0; i < mem_remset_n; i++)
+	  *(mem_remset[i]) = mem_copy (*(mem_remset[i]));
+
+#ifdef GC_CONSERVATIVE
+      for (int i = 0; i < mem_young_n_pins; i++)
+	{
+	  val *ptr = mem_young_pins[i].ptr;
+	  if (mem_young_pins[i].pair)
+	    mem_scan_pair (ptr);
+	  else
+	    mem_scan (ptr);
+	}
+#endif
+
+      val *ptr = mem_new.first;
+      val *pair = mem_new.end;
+      while (ptr < mem_new.next || pair > mem_new.pairs || mem_large_gray)
+	{
+	  if (ptr < mem_new.next)
+	    ptr = mem_scan (ptr);
+	  else if (pair > mem_new.pairs)
+	    {
+	      pair -= 2;
+	      mem_prefetch_pair (pair, &mem_new);
+	      mem_scan_pair (pair);
+	    }
+	  else
+	    mem_scan_large ();
+	  count++;
+	}
+    }
+
+  val *scan = mem_new.next, *pair_scan = mem_new.pairs;
+  mem_weak_trace (weak, &scan, &pair_scan);
+  mem_weak_clear (weak, mem_weak_alive);
+  if (mem_marking || mem_hash_young > 0)
+    mem_hash_sweep (mem_weak_alive);
+
+#ifdef GC_CONSERVATIVE
+  mem_keep_pins (remembered);
+#else
+  mem_young.next = mem_young.first;
+  mem_young.pairs = mem_young.end;
+  mem_remset_n = 0;
+#endif
+
+  mem_free_dead_large ();
+
+  return count;
+}
+
+/* Incremental collection
+
+   A major collection needs to copy all living data in one go, which
+   stops the program for a noticeable time when there is a lot of it.
+   In incremental mode, major collections are instead performed in many
+   small steps, interleaved with the program, as described by Baker in
+   "List Processing in Real Time on a Serial Computer".
+
+   A 'cycle' starts by flipping the roles of the old generation and the
+   spare region: the old generation becomes the from space, and the
+   empty spare region becomes the new old generation.  All root values
+   are copied, but nothing is scanned yet.  From now on, every time the
+   program has allocated MEM_INCR_STEP words, the collector scans up to
+   MEM_INCR_RATE times as many words of the new old generation, and
+   copies the objects that they refer to.  When the scan catches up
+   with the end of the old generation, the cycle is over, and the from
+   space becomes the spare region.  Minor collections and large
+   allocations during a cycle put their objects at the end of the new
+   old generation, where they will be scanned as well.
+
+   The program must never see a pointer into the from space: it could
+   store it into an object that has already been scanned.  Thus, all
+   loads from the heap go through 'mem_read_barrier', which copies the
+   object that a loaded value refers to, if it is still in the from
+   space, and updates the location that it was loaded from.  Since the
+   nursery is empty at the start of a cycle, no young object ever
+   refers to the from space either.  Large objects are marked by the
+   read barrier, and those that are allocated during a cycle are
+   marked right away.
+
+   Incremental mode is turned on by setting a pause budget, in
+   microseconds, with the --gc-pause option or the SUO_GC_PAUSE
+   environment variable.  A step stops early when it exceeds the
+   budget.  If the collector can not keep up with the program, the
+   cycle is finished in one go.  Every pause is measured, and the
+   longest one is reported at exit.  A pause is a call of 'mem_gc' that
+   collected the nursery or did a step, see 'Statistics'.
+*/
+
+#define MEM_INCR_STEP 1024
+#define MEM_INCR_RATE 8
+
+long mem_pause_budget = 0;
+double mem_survival = 0;
+bool mem_incr_active = false;
+val *mem_incr_scan;
+val *mem_incr_pair_scan;
+word mem_incr_promoted;
+
+void
+mem_set_pause_budget (char *str)
+{
+  mem_pause_budget = atol (str);
+#ifdef GC_CONSERVATIVE
+  if (mem_pause_budget > 0)
+    {
+      printf ("incremental collection needs precise roots\n");
+      exit (1);
+    }
+#endif
+}
+
+struct timespec mem_pause_start;
+long mem_pause_max = 0;
+long mem_pause_total = 0;
+long mem_pause_count = 0;
+
+long
+mem_pause_elapsed ()
+{
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return ((now.tv_sec - mem_pause_start.tv_sec) * 1000000
+	  + (now.tv_nsec - mem_pause_start.tv_nsec) / 1000);
+}
+
+void
+mem_pause_begin ()
+{
+  clock_gettime (CLOCK_MONOTONIC, &mem_pause_start);
+}
+
+long
+mem_pause_end ()
+{
+  long t = mem_pause_elapsed ();
+  if (t > mem_pause_max)
+    mem_pause_max = t;
+  mem_pause_total += t;
+  mem_pause_count++;
+
+  int i = 0;
+  while (i < MEM_PAUSE_BUCKETS-1 && t >= (1l << i))
+    i++;
+  mem_stats.pauses[i]++;
+
+  return t;
+}
+
+void
+mem_report_pauses ()
+{
+  fprintf (stderr, "GC: %ld pauses, %lu of them steps, longest %ld us, "
+	   "average %ld us, budget %ld us\n",
+	   mem_pause_count, mem_stats.incr_steps, mem_pause_max,
+	   mem_pause_count? mem_pause_total / mem_pause_count : 0,
+	   mem_pause_budget);
+}
+
+val
+mem_read_barrier (val *slot)
+{
+  val v = *slot;
+  if (mem_incr_active && val_ptr_p (v))
+    {
+      val *ptr = val_ptr_any_tag (v);
+      if (ptr >= mem_from.first && ptr < mem_from.end)
+	*slot = v = mem_copy (v);
+      else if (mem_large_p (ptr))
+	mem_mark_large (ptr);
+    }
+  return v;
+}
+
+/* The number of free words in the old generation.  During a cycle,
+   enough room must be kept for the objects in the from space that
+   might still need to be copied.
+*/
+
+word
+mem_old_free ()
+{
+  word free = mem_old.pairs - mem_old.next;
+
+#ifdef GC_CONSERVATIVE
+  /* An island might need a header.
+   */
+  word islands = mem_islands_words (&mem_old_islands);
+  free = free > islands? free - islands : 0;
+#endif
+
+  if (mem_incr_active)
+    {
+      word copied = mem_space_used (&mem_old) - mem_incr_promoted;
+      word uncopied = mem_space_used (&mem_from) - copied;
+      free = free > uncopied? free - uncopied : 0;
+    }
+
+  return free;
+}
+
+/* The room needed for copying N words.  Parallel workers waste some
+   of it at the ends of their chunks.
+*/
+
+word
+mem_copy_need (word n)
+{
+  if (mem_gc_threads > 1)
+    n += n/4 + mem_gc_threads*MEM_CHUNK_SIZE;
+  return n;
+}
+
+word
+mem_minor_need ()
+{
+#ifdef GC_CONSERVATIVE
+  return mem_copy_need (mem_space_used (&mem_young)
+			+ mem_islands_words (&mem_young_islands));
+#else
+  return mem_copy_need (mem_space_used (&mem_young));
+#endif
+}
+
+void
+mem_gc_minor ()
+{
+  struct mem_space from = mem_from;
+  struct mem_space *to = mem_to;
+  bool marking = mem_marking;
+
+  /* During a cycle, the gray large objects must be scanned by the
+     cycle, which copies what they refer to from the from space.
+  */
+  struct mem_large *gray = mem_large_gray;
+  mem_large_gray = NULL;
+
+#ifdef GC_CONSERVATIVE
+  mem_pin_young ();
+#endif
+
+  mem_from.first = mem_from.next = mem_from.pairs = mem_from.end = NULL;
+  mem_from_young = true;
+  mem_marking = false;
+
+  mem_new.first = mem_new.next = mem_old.next;
+  mem_new.end = mem_new.pairs = mem_old.pairs;
+  mem_to = &mem_new;
+
+  word young = mem_space_used (&mem_young);
+  word copied = mem_stats_words (&mem_stats_copied);
+  int count = mem_collect ();
+
+  word promoted = mem_space_used (&mem_new);
+  copied = mem_stats_words (&mem_stats_copied) - copied;
+  mem_stats_survival = (double)copied / (young? young : 1);
+  mem_stats_what |= MEM_STATS_MINOR;
+  mem_stats.minor++;
+  mem_old.next = mem_new.next;
+  mem_old.pairs = mem_new.pairs;
+  mem_incr_promoted += promoted;
+  mem_new.first = mem_new.next = mem_new.pairs = mem_new.end = NULL;
+
+  dbg ("GC: minor, promoted %d objects, %lu words (%02f%%)\n",
+       count, (unsigned long)promoted,
+       mem_space_used (&mem_old)*100.0/mem_size);
+
+  mem_from = from;
+  mem_from_young = false;
+  mem_to = to;
+  mem_marking = marking;
+  mem_large_gray = gray;
+}
+
+void
+mem_resize_spare (word size)
+{
+  if (mem_spare.end - mem_spare.first != ((size+1)&~1))
+    {
+      mem_space_free (&mem_spare);
+      mem_space_alloc (&mem_spare, size);
+    }
+}
+
+/* Choose the size of the next old generation so that, after allocating
+   NEED more words, the living data fills it to the target ratio.
+*/
+
+word
+mem_desired_size (word need)
+{
+  word live = mem_space_used (&mem_old);
+  double size = (live + need) / mem_target_live_ratio;
+
+  if (size < mem_min_size)
+    return mem_min_size;
+  if (size > mem_max_size)
+    return mem_max_size;
+  return size;
+}
+
+/* Collect both generations, and make sure that NEED words are free in
+   the old generation afterwards, if the maximum heap size allows it.
+*/
+
+void
+mem_gc_major (word need)
+{
+  /* The spare region must be able to hold everything, in case
+     everything survives.
+  */
+  word used = mem_space_used (&mem_old) + mem_space_used (&mem_young);
+  word room = mem_copy_need (used);
+  if (mem_spare.end - mem_spare.first < room)
+    mem_resize_spare (room < mem_max_size? room : mem_max_size);
+
+  mem_from = mem_old;
+  mem_from_young = true;
+  mem_new = mem_spare;
+  mem_new.next = mem_new.first;
+  mem_new.pairs = mem_new.end;
+  mem_to = &mem_new;
+  mem_marking = true;
+
+  int count = mem_collect ();
+
+  mem_survival = (double)mem_space_used (&mem_new) / (used? used : 1);
+  mem_stats_survival = mem_survival;
+  mem_stats_what |= MEM_STATS_MAJOR;
+  mem_stats.major++;
+
+  mem_marking = false;
+  mem_sweep_large ();
+  mem_free_dead_large ();
+
+  mem_spare = mem_old;
+  mem_space_release (&mem_spare);
+  mem_old = mem_new;
+  mem_size = mem_old.end - mem_old.first;
+
+  mem_from.first = mem_from.next = mem_from.pairs = mem_from.end = NULL;
+  mem_from_young = false;
+  mem_new.first = mem_new.next = mem_new.pairs = mem_new.end = NULL;
+  mem_to = NULL;
+
+  dbg ("GC: major, copied %d objects, %lu words (%02f%%)\n",
+       count, (unsigned long)mem_space_used (&mem_old),
+       mem_space_used (&mem_old)*100.0/mem_size);
+
+  word desired = mem_desired_size (need);
+  if (desired > mem_size || desired < mem_size/2)
+    {
+      mem_resize_spare (desired);
+      if (mem_old_free () < need && desired > mem_size)
+	mem_gc_major (need);
+    }
+}
+
+/* Start a cycle right after a minor collection, when the nursery is
+   empty.  This fails when the heap is not allowed to grow enough to
+   hold a copy of the old generation plus the objects that will be
+   promoted during the cycle.
+*/
+
+bool
+mem_incr_start ()
+{
+  word used = mem_space_used (&mem_old);
+  word size = mem_desired_size (mem_young_size);
+
+  if (size < used + 2*mem_young_size)
+    return false;
+  if (mem_spare.end - mem_spare.first < size)
+    mem_resize_spare (size);
+
+  mem_from = mem_old;
+  mem_old = mem_spare;
+  mem_old.next = mem_old.first;
+  mem_old.pairs = mem_old.end;
+  mem_to = &mem_old;
+  mem_spare.first = mem_spare.next = mem_spare.pairs = mem_spare.end = NULL;
+
+  mem_incr_scan = mem_old.first;
+  mem_incr_pair_scan = mem_old.end;
+  mem_incr_promoted = 0;
+  mem_incr_active = true;
+  mem_marking = true;
+  mem_hash_mark_from ();
+
+  for (int i = 0; i < mem_n_roots; i++)
+    *(mem_roots[i]) = mem_copy (*(mem_roots[i]));
+  for (int i = 0; i < mem_perm_n; i++)
+    *(mem_perm_slots[i]) = mem_copy (*(mem_perm_slots[i]));
+
+  return true;
+}
+
+void
+mem_incr_finish ()
+{
+  mem_scan_to (&mem_incr_scan, &mem_incr_pair_scan);
+  mem_weak_trace (0, &mem_incr_scan, &mem_incr_pair_scan);
+  mem_weak_clear (0, mem_weak_alive);
+  mem_hash_sweep (mem_weak_alive);
+  free (mem_hash_from_bits);
+  mem_hash_from_bits = NULL;
+
+  mem_spare = mem_from;
+  mem_space_release (&mem_spare);
+  mem_from.first = mem_from.next = mem_from.pairs = mem_from.end = NULL;
+  mem_to = NULL;
+  mem_incr_active = false;
+  mem_marking = false;
+  mem_sweep_large ();
+  mem_size = mem_old.end - mem_old.first;
+
+  dbg ("GC: incremental cycle done, %lu words (%02f%%)\n",
+       (unsigned long)mem_space_used (&mem_old),
+       mem_space_used (&mem_old)*100.0/mem_size);
+
+  word desired = mem_desired_size (mem_young_size);
+  if (desired > mem_size || desired < mem_size/2)
+    mem_resize_spare (desired);
+}
+
+void
+mem_incr_step ()
+{
+  word work = 0;
+  int count = 0;
+
+  mem_stats_what |= MEM_STATS_INCR;
+  mem_stats.incr_steps++;
+
+  while ((mem_incr_scan < mem_old.next || mem_incr_pair_scan > mem_old.pairs
+	  || mem_large_gray)
+	 && work < MEM_INCR_RATE*MEM_INCR_STEP)
+    {
+      if (mem_incr_scan < mem_old.next)
+	{
+	  val *next = mem_scan (mem_incr_scan);
+	  work += next - mem_incr_scan;
+	  mem_incr_scan = next;
+	}
+      else if (mem_incr_pair_scan > mem_old.pairs)
+	{
+	  mem_scan_pair (mem_incr_pair_scan -= 2);
+	  work += 2;
+	}
+      else
+	{
+	  work += mem_large_gray->size;
+	  mem_scan_large ();
+	}
+
+      if ((++count & 63) == 0 && mem_pause_elapsed () > mem_pause_budget)
+	break;
+    }
+
+  if (mem_incr_scan == mem_old.next && mem_incr_pair_scan == mem_old.pairs
+      && !mem_large_gray)
+    mem_incr_finish ();
+}
+
+/* Mark-compact collection
+
+   A major collection needs a spare region that is big enough to hold
+   all living objects.  When most of the heap survives anyway, this
+   doubles the memory use for little gain.  Thus, when more than
+   MEM_COMPACT_THRESHOLD of the heap survived the previous major
+   collection, the next one compacts the old generation in place
+   instead, and the spare region is given back to the system.
+
+   The compactor slides all living objects towards the start of the
+   old generation, so that they keep their order.  It works in four
+   phases, much like the 'Compressor' of Kermany and Petrank:
+
+   First, all reachable objects are marked in a bitmap with one bit
+   per two words.  All bits that are covered by an object are set, not
+   just the first.  Young and large objects are marked as well, so
+   that we can find the objects that they refer to, but they don't
+   move.
+
+   Second, the number of marked bits before each word of the bitmap is
+   counted.  The new address of every living word of the old
+   generation can then be computed quickly from the bitmap alone.
+
+   Third, all pointers in the roots and in living objects are changed
+   to point to the new addresses, and the remembered locations are
+   moved along with their objects.
+
+   Fourth, each run of living words in the old generation is moved
+   down to its new address.  Pairs are moved up instead, towards the
+   end of the space, and a pair is always a single bit of the bitmap.
+
+   The nursery is left alone and a minor collection follows, unless
+   compaction didn't free enough room for it.  In that case, the heap
+   is grown with a normal major collection.
+
+   Pinned objects (see 'Conservative roots') divide the object part
+   into segments.  The objects between two pinned objects slide down
+   towards the end of the first one; their new addresses only depend
+   on the number of living words between them and that pinned object.
+   The gaps that remain in front of pinned objects are filled with
+   byte vectors.  Pairs all have the same size, so they are simply
+   packed into the free slots at the end of the space, skipping the
+   pinned pairs.
+*/
+
+#define MEM_COMPACT_THRESHOLD 0.75
+
+word *mem_compact_bits;
+word *mem_compact_young_bits;
+word *mem_compact_prefix;
+word mem_compact_live;
+val *mem_compact_end;
+
+word *mem_compact_pin_bits;
+struct mem_pin *mem_compact_pins;
+int mem_compact_n_pins;
+
+val *mem_mark_stack;
+int mem_mark_stack_n = 0;
+int mem_mark_stack_size = 0;
+
+bool
+mem_old_p (val *ptr)
+{
+  return ptr >= mem_old.first && ptr < mem_old.end;
+}
+
+/* Return the first pointer field of the object at PTR and store the
+   end of its fields in END.  The descriptor of a record is not
+   included.  PTR must not be a pair.
+*/
+
+val *
+mem_obj_fields (val *ptr, val **end)
+{
+  sword size;
+
+  if (vec_ptr_p (ptr))
+    {
+      size = flat_ptr_p (ptr)? 0 : vec_ptr_len (ptr);
+      ptr += 1;
+    }
+  else if (bytev_ptr_p (ptr))
+    size = 0;
+  else if (code_ptr_p (ptr))
+    {
+      int b = code_ptr_lit_begin (ptr);
+      size = code_ptr_lit_end (ptr) - b;
+      ptr += b;
+    }
+  else if (rec_ptr_p (ptr))
+    {
+      size = fixnum_num (rec_ptr (rec_ptr_desc (ptr))[0]);
+      if (size < 0)
+	size = 0;
+      ptr += 1;
+    }
+  else
+    abort ();
+
+  *end = ptr + size;
+  return ptr;
+}
+
+void
+mem_mark_push (val v)
+{
+  if (mem_mark_stack_n == mem_mark_stack_size)
+    {
+      mem_mark_stack_size = 2*mem_mark_stack_size + 256;
+      mem_mark_stack = realloc (mem_mark_stack,
+				mem_mark_stack_size*sizeof(val));
+      if (mem_mark_stack == NULL)
+	abort ();
+    }
+
+  mem_mark_stack[mem_mark_stack_n++] = v;
+}
+
+void
+mem_mark (val v)
+{
+  if (!val_ptr_p (v))
+    return;
+
+  val *ptr = val_ptr_any_tag (v);
+  if (mem_perm_p (ptr))
+    return;
+
+  if (mem_old_p (ptr) || mem_young_p (ptr))
+    {
+#ifdef GC_CONSERVATIVE
+      struct mem_space *s = mem_young_p (ptr)? &mem_young : &mem_old;
+      if (pair_p (v) && ptr < s->next)
+	{
+	  mem_mark (mem_wrapper (ptr));
+	  return;
+	}
+#endif
+
+      val *base = mem_young_p (ptr)? mem_young.first : mem_old.first;
+      word *bits = (mem_young_p (ptr)
+		    ? mem_compact_young_bits : mem_compact_bits);
+      word i = (ptr - base) / 2;
+
+      if (mem_bit (bits, i))
+	return;
+
+      word n = pair_p (v)? 1 : (mem_obj_size (ptr, ptr[0]) + 1) / 2;
+      mem_set_bits (bits, i, n);
+    }
+  else
+    {
+      struct mem_large *l = mem_large_header (ptr);
+      if (l->mark)
+	return;
+      l->mark = 1;
+    }
+
+  mem_mark_push (v);
+}
+
+#ifdef GC_CONSERVATIVE
+
+void
+mem_mark_pins ()
+{
+  for (int i = 0; i < mem_young_n_pins; i++)
+    mem_mark (mem_pin_val (&mem_young_pins[i]));
+  for (int i = 0; i < mem_compact_n_pins; i++)
+    mem_mark (mem_pin_val (&mem_compact_pins[i]));
+
+  for (int i = 0; i < mem_ambig_n; i++)
+    {
+      val *p = mem_ambig[i];
+      if (mem_young_p (p) || mem_old_p (p))
+	continue;
+
+      for (struct mem_large *l = mem_large_objs; l; l = l->next)
+	if (p >= l->obj && p < l->obj + l->size)
+	  {
+	    struct mem_pin pin = { l->obj, l->size, false };
+	    mem_mark (mem_pin_val (&pin));
+	  }
+    }
+}
+
+#endif
+
+/* Weak objects are put on the weak list instead of being followed,
+   see 'Weak references'.
+*/
+
+void
+mem_mark_drain ()
+{
+  while (mem_mark_stack_n > 0)
+    {
+      val v = mem_mark_stack[--mem_mark_stack_n];
+      val *ptr = val_ptr_any_tag (v), *end;
+
+      if (pair_p (v))
+	{
+	  mem_mark (ptr[0]);
+	  mem_mark (ptr[1]);
+	  continue;
+	}
+
+      if (weak_ptr_p (ptr) || eph_ptr_p (ptr))
+	{
+	  mem_weak_add (ptr);
+	  continue;
+	}
+
+      if (rec_ptr_p (ptr))
+	mem_mark (rec_ptr_desc (ptr));
+      for (val *f = mem_obj_fields (ptr, &end); f < end; f++)
+	mem_mark (*f);
+    }
+}
+
+bool
+mem_weak_marked (val *slot)
+{
+  val v = *slot;
+  if (!val_ptr_p (v))
+    return true;
+
+  val *ptr = val_ptr_any_tag (v);
+  if (mem_perm_p (ptr))
+    return true;
+  if (mem_old_p (ptr))
+    return mem_bit (mem_compact_bits, (ptr - mem_old.first) / 2);
+  if (mem_young_p (ptr))
+    return mem_bit (mem_compact_young_bits, (ptr - mem_young.first) / 2);
+  return mem_large_header (ptr)->mark;
+}
+
+void
+mem_mark_all ()
+{
+  int weak = mem_weak_n;
+
+  for (int i = 0; i < mem_n_roots; i++)
+    mem_mark (*(mem_roots[i]));
+  for (int i = 0; i < mem_perm_n; i++)
+    mem_mark (*(mem_perm_slots[i]));
+#ifdef GC_CONSERVATIVE
+  mem_mark_pins ();
+#endif
+  mem_mark_drain ();
+
+  bool more = true;
+  while (more)
+    {
+      for (int i = weak; i < mem_weak_n; i++)
+	{
+	  val *ptr = mem_weak_objs[i];
+	  if (eph_ptr_p (ptr))
+	    for (word j = 1; j < vec_ptr_len (ptr); j += 2)
+	      if (mem_weak_marked (&ptr[j]))
+		mem_mark (ptr[j+1]);
+	}
+      more = mem_mark_stack_n > 0;
+      mem_mark_drain ();
+    }
+
+  mem_weak_clear (weak, mem_weak_marked);
+}
+
+/* The number of marked bits before bit I.
+ */
+
+word
+mem_compact_count (word i)
+{
+  word before = mem_compact_bits[i/32] & ((1u << i%32) - 1);
+  return mem_compact_prefix[i/32] + __builtin_popcount (before);
+}
+
+/* The number of pinned objects that start below PTR.
+ */
+
+int
+mem_compact_pins_below (val *ptr)
+{
+  int lo = 0, hi = mem_compact_n_pins;
+
+  while (lo < hi)
+    {
+      int mid = (lo + hi) / 2;
+      if (mem_compact_pins[mid].ptr < ptr)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+
+  return lo;
+}
+
+word
+mem_compact_pin_start (int k)
+{
+  return (mem_compact_pins[k].ptr - mem_old.first) / 2;
+}
+
+word
+mem_compact_pin_end (int k)
+{
+  return mem_compact_pin_start (k) + (mem_compact_pins[k].size + 1) / 2;
+}
+
+/* The new index of the marked bit I in the object part, when the
+   pinned object K is the last one at or before it, or K is -1.  Such
+   an object is preceded by all living objects between pinned object K
+   and itself.
+*/
+
+word
+mem_compact_slide_down (int k, word i)
+{
+  if (k < 0)
+    return mem_compact_count (i);
+
+  word e = mem_compact_pin_end (k);
+  if (i < e)
+    return i;
+  return e + mem_compact_count (i) - mem_compact_count (e);
+}
+
+/* The index of the R-th free pair slot below the new end of the
+   space, counting from one.  The pinned pairs are not free.
+*/
+
+word
+mem_compact_pair_slot (word r)
+{
+  word d = (mem_compact_end - mem_old.first) / 2 - r;
+
+  for (int k = mem_compact_n_pins - 1; k >= 0; k--)
+    {
+      if (mem_compact_pin_start (k) < d)
+	break;
+      d--;
+    }
+
+  return d;
+}
+
+/* The new index of the marked bit I in the pair part.  A pair is
+   followed by all unpinned living pairs after it.
+*/
+
+word
+mem_compact_pair_dest (word i)
+{
+  if (mem_bit (mem_compact_pin_bits, i))
+    return i;
+
+  int pinned = (mem_compact_n_pins
+		- mem_compact_pins_below (mem_old.first + 2*i));
+  return mem_compact_pair_slot (mem_compact_live - mem_compact_count (i)
+				- pinned);
+}
+
+/* The new address of the word at PTR, which must be marked.
+ */
+
+val *
+mem_compact_fwd (val *ptr)
+{
+  word off = ptr - mem_old.first;
+  word i = off / 2;
+
+  if (mem_space_pair_p (&mem_old, ptr))
+    return mem_old.first + 2*mem_compact_pair_dest (i) + off%2;
+  else
+    {
+      int k = mem_compact_pins_below (mem_old.first + 2*(i+1)) - 1;
+      return mem_old.first + 2*mem_compact_slide_down (k, i) + off%2;
+    }
+}
+
+void
+mem_compact_update (val *slot)
+{
+  val v = *slot;
+  if (val_ptr_p (v) && mem_old_p (val_ptr_any_tag (v)))
+    *slot = val_ptr_make (mem_compact_fwd (val_ptr_any_tag (v)),
+			  val_tag (v, 3));
+}
+
+bool
+mem_compact_alive (val *slot)
+{
+  if (!mem_weak_marked (slot))
+    return false;
+  mem_compact_update (slot);
+  return true;
+}
+
+/* The fields of a record must be found before its descriptor is
+   changed, since the descriptor hasn't moved yet.
+*/
+
+void
+mem_compact_update_obj (val *ptr)
+{
+  val *end;
+
+  for (val *f = mem_obj_fields (ptr, &end); f < end; f++)
+    mem_compact_update (f);
+  if (rec_ptr_p (ptr))
+    {
+      val desc = rec_ptr_desc (ptr);
+      mem_compact_update (&desc);
+      ptr[0] = rec_header_make (desc);
+    }
+}
+
+/* Update all objects in S that are marked in BITS.
+ */
+
+void
+mem_compact_update_space (struct mem_space *s, word *bits)
+{
+  val *ptr = s->first;
+  while (ptr < s->next)
+    {
+      val *next = mem_align (ptr + mem_obj_size (ptr, ptr[0]));
+      if (mem_bit (bits, (ptr - s->first) / 2))
+	mem_compact_update_obj (ptr);
+      ptr = next;
+    }
+
+  for (ptr = s->pairs; ptr < s->end; ptr += 2)
+    if (mem_bit (bits, (ptr - s->first) / 2))
+      {
+	mem_compact_update (ptr);
+	mem_compact_update (ptr + 1);
+      }
+}
+
+/* Dead young objects might still point to the old places of moved
+   objects.  Nobody looks at them anymore, except the heap checker, but
+   we turn them into byte vectors anyway, and clear dead pairs.  Since
+   all words of living objects are marked, the unmarked runs are
+   exactly the dead ones.
+*/
+
+void
+mem_compact_fill_young ()
+{
+  word granules = (mem_young.next - mem_young.first) / 2;
+  word i = 0;
+
+  while (i < granules)
+    {
+      if (mem_bit (mem_compact_young_bits, i))
+	{
+	  i++;
+	  continue;
+	}
+
+      word j = i;
+      while (j < granules && !mem_bit (mem_compact_young_bits, j))
+	j++;
+
+      mem_fill (mem_young.first + 2*i, 2*(j - i));
+      i = j;
+    }
+
+  for (val *ptr = mem_young.pairs; ptr < mem_young.end; ptr += 2)
+    if (!mem_bit (mem_compact_young_bits, (ptr - mem_young.first) / 2))
+      mem_fill_pairs (ptr, 2);
+}
+
+/* The runs that are moved end at pinned objects, since those don't
+   move.
+*/
+
+bool
+mem_compact_moves_p (word i)
+{
+  return (mem_bit (mem_compact_bits, i)
+	  && !mem_bit (mem_compact_pin_bits, i));
+}
+
+void
+mem_compact ()
+{
+  word granules = (mem_old.end - mem_old.first) / 2;
+  word pair_start = (mem_old.pairs - mem_old.first) / 2;
+  word n_words = granules / 32 + 1;
+  word used = mem_space_used (&mem_old);
+
+  mem_compact_bits = calloc (n_words, sizeof (word));
+  mem_compact_young_bits = calloc ((mem_young_size/2 + 31) / 32,
+				   sizeof (word));
+  mem_compact_prefix = malloc (n_words * sizeof (word));
+  mem_compact_pin_bits = calloc (n_words, sizeof (word));
+  if (!mem_compact_bits || !mem_compact_young_bits || !mem_compact_prefix
+      || !mem_compact_pin_bits)
+    abort ();
+
+  mem_compact_pins = NULL;
+  mem_compact_n_pins = 0;
+#ifdef GC_CONSERVATIVE
+  mem_fold_islands ();
+  pair_start = (mem_old.pairs - mem_old.first) / 2;
+  mem_pin_young ();
+  mem_compact_n_pins = mem_find_pins (&mem_old, &mem_old_islands,
+				      mem_compact_pin_bits,
+				      &mem_compact_pins);
+#endif
+
+  mem_mark_all ();
+
+  word live = 0;
+  for (word i = 0; i < n_words; i++)
+    {
+      mem_compact_prefix[i] = live;
+      live += __builtin_popcount (mem_compact_bits[i]);
+    }
+  mem_compact_live = live;
+  mem_compact_end = mem_old.end;
+
+#ifdef GC_CONSERVATIVE
+  /* The old generation can't be copied into a bigger one, so it grows
+     in place.  The objects below a pinned one don't fill the gap in
+     front of it, so the room is counted from where the objects will
+     end rather than from how many of them live.
+  */
+  word obj_end = mem_compact_slide_down (mem_compact_pins_below (mem_old.pairs)
+					 - 1, pair_start);
+  word live_pairs = live - mem_compact_count (pair_start);
+  double size = ((2*(obj_end + live_pairs) + mem_young_size)
+		 / mem_target_live_ratio);
+  if (size > mem_max_size)
+    size = mem_max_size;
+  if (size > mem_size)
+    mem_compact_end = mem_old.first + (((word)size + 1) & ~1);
+#endif
+
+  for (int i = 0; i < mem_n_roots; i++)
+    mem_compact_update (mem_roots[i]);
+  for (int i = 0; i < mem_perm_n; i++)
+    mem_compact_update (mem_perm_slots[i]);
+  mem_compact_update_space (&mem_young, mem_compact_young_bits);
+#ifdef GC_CONSERVATIVE
+  for (int i = 0; i < mem_young_islands.n; i++)
+    {
+      struct mem_pin *in = &mem_young_islands.pins[i];
+      if (!mem_bit (mem_compact_young_bits, (in->ptr - mem_young.first) / 2))
+	continue;
+      if (in->pair)
+	{
+	  mem_compact_update (in->ptr);
+	  mem_compact_update (in->ptr + 1);
+	}
+      else
+	mem_compact_update_obj (in->ptr);
+    }
+#endif
+  mem_compact_update_space (&mem_old, mem_compact_bits);
+  mem_compact_fill_young ();
+  for (struct mem_large *l = mem_large_objs; l; l = l->next)
+    if (l->mark)
+      mem_compact_update_obj (l->obj);
+
+  int n = 0;
+  for (int i = 0; i < mem_remset_n; i++)
+    {
+      val *slot = mem_remset[i];
+      if (mem_old_p (slot))
+	{
+	  if (!mem_bit (mem_compact_bits, (slot - mem_old.first) / 2))
+	    continue;
+	  slot = mem_compact_fwd (slot);
+	}
+      mem_remset[n++] = slot;
+    }
+  mem_remset_n = n;
+  mem_hash_sweep (mem_compact_alive);
+
+  word i = 0;
+  while (i < pair_start)
+    {
+      if (!mem_compact_moves_p (i))
+	{
+	  i++;
+	  continue;
+	}
+
+      word j = i;
+      while (j < pair_start && mem_compact_moves_p (j))
+	j++;
+
+      val *ptr = mem_old.first + 2*i;
+      memmove (mem_compact_fwd (ptr), ptr, 2*(j - i)*sizeof(val));
+      i = j;
+    }
+
+  /* Pairs move up, so the runs are moved starting from the top.  A
+     run must not jump over a pinned pair.
+  */
+  int n_obj_pins = mem_compact_pins_below (mem_old.pairs);
+  int n_pair_pins = mem_compact_n_pins - n_obj_pins;
+  i = granules;
+  while (i > pair_start)
+    {
+      if (!mem_compact_moves_p (i - 1))
+	{
+	  i--;
+	  continue;
+	}
+
+      word j = i - 1;
+      while (j > pair_start && mem_compact_moves_p (j - 1)
+	     && n_pair_pins == 0)
+	j--;
+
+      val *ptr = mem_old.first + 2*j;
+      memmove (mem_compact_fwd (ptr), ptr, 2*(i - j)*sizeof(val));
+      i = j;
+    }
+
+  /* Fill the gaps in front of the pinned objects.
+   */
+  for (int k = 0; k < n_obj_pins; k++)
+    {
+      word start = mem_compact_slide_down (k - 1, mem_compact_pin_start (k));
+      mem_fill (mem_old.first + 2*start,
+		2*(mem_compact_pin_start (k) - start));
+    }
+
+  word pairs = mem_compact_live - mem_compact_count (pair_start) - n_pair_pins;
+  mem_old.next = (mem_old.first
+		  + 2*mem_compact_slide_down (n_obj_pins - 1, pair_start));
+  mem_old.pairs = (pairs > 0
+		   ? mem_old.first + 2*mem_compact_pair_slot (pairs)
+		   : mem_compact_end);
+  mem_old.end = mem_compact_end;
+
+#ifdef GC_CONSERVATIVE
+  /* The pinned pairs below the others become islands.
+   */
+  struct mem_islands *is = &mem_old_islands;
+  is->pins = realloc (is->pins, n_pair_pins * sizeof (struct mem_pin));
+  for (int k = n_obj_pins; k < mem_compact_n_pins; k++)
+    if (mem_compact_pins[k].ptr < mem_old.pairs)
+      is->pins[is->n++] = mem_compact_pins[k];
+#endif
+  mem_size = mem_old.end - mem_old.first;
+  mem_survival = (double)(2*live) / (used? used : 1);
+  mem_stats_survival = mem_survival;
+  mem_stats_what |= MEM_STATS_COMPACT;
+  mem_stats.compact++;
+
+  dbg ("GC: compact, %lu words (%02f%%)\n",
+       (unsigned long)mem_space_used (&mem_old),
+       mem_space_used (&mem_old)*100.0/mem_size);
+
+  free (mem_compact_bits);
+  free (mem_compact_young_bits);
+  free (mem_compact_prefix);
+  free (mem_compact_pin_bits);
+  free (mem_compact_pins);
+  mem_compact_n_pins = 0;
+
+  mem_sweep_large ();
+}
+
+/* Collect the old generation, and empty the nursery.  Compact when the
+   heap can't grow or when most of it survived the last time.  With
+   conservative roots, always compact.
+*/
+
+void
+mem_gc_full ()
+{
+#ifdef GC_CONSERVATIVE
+  mem_space_free (&mem_spare);
+
+  mem_compact ();
+
+  if (mem_old_free () < mem_minor_need ())
+    {
+      printf ("FULL\n");
+      abort ();
+    }
+  mem_gc_minor ();
+#else
+  if (mem_survival <= MEM_COMPACT_THRESHOLD)
+    {
+      mem_gc_major (mem_young_size);
+      return;
+    }
+
+  mem_space_free (&mem_spare);
+
+  mem_compact ();
+
+  if (mem_old_free () < mem_minor_need () + mem_young_size)
+    mem_gc_major (mem_young_size);
+  else
+    mem_gc_minor ();
+#endif
+}
+
+/* Add a large object of N words, without collecting.
+ */
+
+val *
+mem_large_new (int n)
+{
+  struct mem_large *l = NULL;
+  if (mem_large_words + n <= mem_max_size)
+    l = mem_large_malloc (mem_large_bytes (n));
+  if (l == NULL)
+    {
+      printf ("FULL\n");
+      abort ();
+    }
+
+#ifdef GC_CONSERVATIVE
+  if (mem_large_lo == NULL || l->obj < mem_large_lo)
+    mem_large_lo = l->obj;
+  if (l->obj + n > mem_large_hi)
+    mem_large_hi = l->obj + n;
+#endif
+
+  l->next = mem_large_objs;
+  l->size = n;
+  l->mark = mem_incr_active;
+  mem_large_objs = l;
+  mem_large_words += n;
+
+  return l->obj;
+}
+
+/* Allocate N words in the large object space, after collecting it
+   when it has grown too much.  In incremental mode, this starts a new
+   cycle instead.
+*/
+
+val *
+mem_large_alloc (int n)
+{
+  if (mem_large_words + n > mem_large_limit && !mem_incr_active)
+    {
+      if (mem_pause_budget > 0)
+	{
+	  mem_gc_minor ();
+	  if (!mem_incr_start ())
+	    mem_gc_major (mem_young_size);
+	}
+      else
+	mem_gc_full ();
+    }
+
+  mem_stats_allocated += n;
+  return mem_large_new (n);
+}
+
+/* Writing the statistics.
+ */
+
+void
+mem_stats_write_copied (struct mem_copy_stats *c)
+{
+  fprintf (mem_stats_file, "\"copied\": {");
+  for (int i = 0; i < mem_n_kinds; i++)
+    fprintf (mem_stats_file, "%s\"%s\": [%lu, %lu]", i? ", " : "",
+	     mem_kind_names[i], c->objects[i], c->words[i]*sizeof (val));
+  fprintf (mem_stats_file, "}");
+}
+
+void
+mem_stats_record (long pause)
+{
+  mem_stats.collections++;
+  mem_stats.allocated += mem_stats_allocated;
+  mem_stats_add (&mem_stats.copied, &mem_stats_copied);
+
+  if (mem_stats_file)
+    {
+      fprintf (mem_stats_file, "{\"gc\": %lu, \"what\": [",
+	       mem_stats.collections);
+      char *sep = "";
+      if (mem_stats_what & MEM_STATS_INCR)
+	fprintf (mem_stats_file, "%s\"incremental\"", sep), sep = ", ";
+      if (mem_stats_what & MEM_STATS_MINOR)
+	fprintf (mem_stats_file, "%s\"minor\"", sep), sep = ", ";
+      if (mem_stats_what & MEM_STATS_MAJOR)
+	fprintf (mem_stats_file, "%s\"major\"", sep), sep = ", ";
+      if (mem_stats_what & MEM_STATS_COMPACT)
+	fprintf (mem_stats_file, "%s\"compact\"", sep);
+
+      fprintf (mem_stats_file,
+	       "], \"pause_us\": %ld, \"allocated\": %lu, "
+	       "\"survival\": %.4f, \"roots\": %d, \"heap\": %lu, "
+	       "\"used\": %lu, \"large\": %lu, ",
+	       pause, mem_stats_allocated*sizeof (val), mem_stats_survival,
+	       mem_n_roots, (unsigned long)mem_size*sizeof (val),
+	       (unsigned long)mem_space_used (&mem_old)*sizeof (val),
+	       (unsigned long)mem_large_words*sizeof (val));
+      mem_stats_write_copied (&mem_stats_copied);
+      fprintf (mem_stats_file, "}\n");
+    }
+
+  mem_stats_what = 0;
+  mem_stats_allocated = 0;
+  memset (&mem_stats_copied, 0, sizeof (mem_stats_copied));
+}
+
+void
+mem_stats_report ()
+{
+  fprintf (mem_stats_file,
+	   "{\"total\": true, \"collections\": %lu, \"minor\": %lu, "
+	   "\"major\": %lu, \"compact\": %lu, \"incremental\": %lu, "
+	   "\"allocated\": %lu, ",
+	   mem_stats.collections, mem_stats.minor, mem_stats.major,
+	   mem_stats.compact, mem_stats.incr_steps,
+	   mem_stats.allocated*sizeof (val));
+  mem_stats_write_copied (&mem_stats.copied);
+
+  fprintf (mem_stats_file, ", \"pauses\": [");
+  for (int i = 0; i < MEM_PAUSE_BUCKETS; i++)
+    fprintf (mem_stats_file, "%s%lu", i? ", " : "", mem_stats.pauses[i]);
+  fprintf (mem_stats_file, "]}\n");
+  fclose (mem_stats_file);
+}
+
+void mem_snapshot_poll (bool wait);
+
+/* Collect both generations at the next allocation, no matter how much
+   room is left.  Like for stress testing, the limits are closed so
+   that the allocation ends up in 'mem_gc'.
+*/
+
+bool mem_full_requested = false;
+
+void
+mem_request_full ()
+{
+  mem_full_requested = true;
+  mem_limit = mem_young.next;
+  mem_pair_limit = mem_young.pairs;
+}
+
+/* Make room for N words, and allocate them.  Small objects are
+   allocated in the nursery, large ones in the large object space.
+   When PAIR is true, a pair is allocated at the top of the nursery.
+
+   We also get here when one end of the nursery reaches its limit
+   while there is still room between the two ends.  The limits are
+   then moved so that the end that needs more room gets three quarters
+   of what is left.  During an incremental cycle, we also get here
+   every MEM_INCR_STEP words to perform a step, even if the nursery
+   isn't full yet, and for every allocation while stress testing.
+*/
+
+val *
+mem_gc (int n, bool pair)
+{
+  mem_pause_begin ();
+
+  mem_stats_allocated += mem_space_used (&mem_young) - mem_stats_young_used;
+
+#ifdef GC_CONSERVATIVE
+  mem_find_ambig ();
+#endif
+
+#ifdef DEBUG
+  mem_check ();
+#endif
+
+  if (mem_incr_active)
+    mem_incr_step ();
+
+#ifdef GC_CONSERVATIVE
+  bool full = (n < MEM_LARGE_SIZE
+	       && !mem_hole_alloc (&mem_young, &mem_young_islands, n, pair,
+				   false));
+#else
+  bool full = n < MEM_LARGE_SIZE && n > mem_young.pairs - mem_young.next;
+#endif
+
+  bool requested = mem_full_requested;
+  mem_full_requested = false;
+
+  if (full || mem_stress_due () || requested)
+    {
+      word need = mem_minor_need ();
+
+      if (mem_incr_active && (requested || mem_old_free () < need))
+	mem_incr_finish ();
+
+      if (requested || mem_old_free () < need)
+	mem_gc_full ();
+      else
+	mem_gc_minor ();
+
+      if (mem_pause_budget > 0 && !mem_incr_active
+	  && mem_old_free () < mem_young_size)
+	mem_incr_start ();
+    }
+
+#ifdef DEBUG
+  mem_check ();
+#endif
+
+  mem_stats_young_used = mem_space_used (&mem_young);
+
+  val *ptr;
+#ifdef GC_CONSERVATIVE
+  if (n < MEM_LARGE_SIZE)
+    {
+      /* Pinned objects might not leave enough room in the nursery.
+       */
+      ptr = mem_hole_alloc (&mem_young, &mem_young_islands, n, pair, true);
+      if (ptr == NULL)
+	{
+	  printf ("FULL\n");
+	  abort ();
+	}
+      mem_prune_islands (&mem_young, &mem_young_islands);
+    }
+  else
+    ptr = mem_large_alloc (n);
+#else
+  if (pair)
+    ptr = mem_young.pairs -= 2;
+  else if (n >= MEM_LARGE_SIZE)
+    ptr = mem_large_alloc (n);
+  else
+    {
+      ptr = mem_young.next;
+      mem_young.next += (n+1)&~1;
+    }
+#endif
+
+  word gap = (mem_young.pairs - mem_young.next) / 2;
+  val *split = (pair
+		? mem_young.next + 2*(gap/4)
+		: mem_young.pairs - 2*(gap/4));
+
+  mem_limit = mem_pair_limit = split;
+#ifdef GC_CONSERVATIVE
+  mem_hole_limits ();
+#endif
+  if (mem_incr_active)
+    {
+      if (mem_young.next + MEM_INCR_STEP/2 < mem_limit)
+	mem_limit = mem_young.next + MEM_INCR_STEP/2;
+      if (mem_young.pairs - MEM_INCR_STEP/2 > mem_pair_limit)
+	mem_pair_limit = mem_young.pairs - MEM_INCR_STEP/2;
+    }
+  mem_stress_limits ();
+
+  if (mem_stats_what)
+    {
+      mem_stats_record (mem_pause_end ());
+      mem_snapshot_poll (false);
+    }
+  return ptr;
+}
+
+/* Heap images
+
+   A process starts by running 'boot_init', and it would eventually
+   have to load a lot more code through the evaluator before it can do
+   anything useful.  Instead, the state of a process can be saved in an
+   image file when it ends, with --dump-image=FILE or SUO_DUMP_IMAGE,
+   and a new process can start from it, with --image=FILE or
+   SUO_IMAGE.
+
+   The image is written after a full collection, which leaves all
+   living objects in the old generation, except the large ones.  It
+   contains the values of the global roots, the object and pair parts
+   of the old generation, and the large objects.  The two parts are
+   page aligned in the file, and a new process maps them copy-on-write
+   to the same places in its own old generation.  The heap is reserved
+   at the same address as in the dumping process when possible, and
+   then all pointers in the image are already right: starting up costs
+   a few page faults, and only the pages that are touched are read.
+   Otherwise, or when there are large objects, which are copied into
+   fresh memory, the image is walked once after mapping it, and its
+   pointers are relocated.
+
+   Every process registers the global roots in the same order, see
+   'boot_init', and an image is only loaded when their number matches.
+   The old generation starts out with the size it had when the image
+   was written.
+
+   The entries of the side table of identity hashes follow the large
+   objects, see 'Identity hashes', so that objects keep their hashes.
+   The names of the symbols come last, each preceded by its length,
+   and are interned again in the same order when the image is loaded,
+   so that every symbol keeps its index.
+
+   The 64bit version, with or without NaN boxing, and the version with
+   compressed values write images with different magics, and no
+   version can load the images of another.
+
+   With compressed values, the addresses in an image are offsets from
+   the start of the heap, and the heap is always reserved with the
+   same layout when the maximum size is the same, so an image needs no
+   relocation then, wherever the heap ends up.  A boot image is loaded
+   like any other image, since its offsets are taken by the heap of
+   the new process.
+
+   An image that is given with --boot-image is mapped as the permanent
+   space instead, see 'The permanent space', and the heap is reserved
+   elsewhere.  That only works when the addresses of the image are
+   still free, and when it has no large objects.  Otherwise, it is
+   loaded like any other image.  A process that runs on a permanent
+   space can't write an image itself.
+*/
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0
+#endif
+
+#if defined (VAL_NAN)
+#define MEM_IMAGE_MAGIC "suonan6"
+#elif defined (VAL_64)
+#define MEM_IMAGE_MAGIC "suo64i6"
+#elif defined (VAL_COMPRESSED)
+#define MEM_IMAGE_MAGIC "suocpi6"
+#else
+#define MEM_IMAGE_MAGIC "suoimg6"
+#endif
+
+struct mem_image_segment {
+  word offset;
+  word addr;
+  word size;
+};
+
+struct mem_image_header {
+  char magic[8];
+  word base;
+  word max_size;
+  word first, next, pairs, end;
+  int n_segments;
+  struct mem_image_segment segments[2];
+  word large_offset;
+  int n_large;
+  int n_roots;
+  word hash_offset;
+  int n_hashes;
+  word hash_counter;
+  word sym_offset;
+  word n_syms;
+};
+
+char *mem_image_name;
+bool mem_image_shared;
+char *mem_dump_image_name;
+FILE *mem_image_file;
+struct mem_image_header mem_image;
+
+void
+mem_set_image (char *str)
+{
+  mem_image_name = str;
+}
+
+void
+mem_set_boot_image (char *str)
+{
+  mem_image_name = str;
+  mem_image_shared = true;
+}
+
+void
+mem_set_dump_image (char *str)
+{
+  mem_dump_image_name = str;
+}
+
+word
+mem_page_round (word bytes)
+{
+  word page = getpagesize ();
+  return (bytes + page-1) & ~(page-1);
+}
+
+/* Give up on writing an image.  A snapshot child leaves with _exit,
+   see 'mem_snapshot_child'.
+*/
+
+bool mem_dump_in_child;
+
+void
+mem_image_dump_fail ()
+{
+  if (mem_dump_in_child)
+    {
+      fflush (stdout);
+      _exit (1);
+    }
+  exit (1);
+}
+
+void
+mem_image_write (FILE *f, word offset, void *ptr, word bytes)
+{
+  if (fseek (f, offset, SEEK_SET) != 0
+      || fwrite (ptr, 1, bytes, f) != bytes)
+    {
+      printf ("can't write %s\n", mem_dump_image_name);
+      mem_image_dump_fail ();
+    }
+}
+
+void
+mem_image_dump ()
+{
+  struct mem_image_header h;
+
+  if (mem_perm.first)
+    {
+      printf ("can't dump an image on top of a boot image\n");
+      mem_image_dump_fail ();
+    }
+
+  if (mem_incr_active)
+    mem_incr_finish ();
+#ifdef GC_CONSERVATIVE
+  /* Only the global roots are left now, and nothing needs to be
+     pinned.
+  */
+  mem_ambig_n = 0;
+#endif
+  mem_gc_full ();
+  if (mem_space_used (&mem_young) > 0 || mem_remset_n > 0)
+    abort ();
+
+  FILE *f = fopen (mem_dump_image_name, "w");
+  if (f == NULL)
+    {
+      printf ("can't open %s\n", mem_dump_image_name);
+      mem_image_dump_fail ();
+    }
+
+  memset (&h, 0, sizeof (h));
+  strcpy (h.magic, MEM_IMAGE_MAGIC);
+  h.base = val_ptr_make (mem_young.first, 0);
+  h.max_size = mem_max_size;
+  h.first = val_ptr_make (mem_old.first, 0);
+  h.next = val_ptr_make (mem_old.next, 0);
+  h.pairs = val_ptr_make (mem_old.pairs, 0);
+  h.end = val_ptr_make (mem_old.end, 0);
+  h.n_roots = mem_n_roots;
+
+  /* The pair part is mapped from the page that contains its start, and
+     both parts are mapped in one go when they share a page.
+  */
+  word objects = mem_page_round ((mem_old.next - mem_old.first)
+				 * sizeof (val));
+  word pairs = (((mem_old.pairs - mem_old.first) * sizeof (val))
+		& ~(getpagesize () - 1));
+  word end = mem_page_round ((mem_old.end - mem_old.first) * sizeof (val));
+  word offset = mem_page_round (sizeof (h) + mem_n_roots*sizeof (val));
+
+  if (pairs <= objects)
+    {
+      h.segments[h.n_segments++] = (struct mem_image_segment) {
+	offset, h.first, end };
+      offset += end;
+    }
+  else
+    {
+      h.segments[h.n_segments++] = (struct mem_image_segment) {
+	offset, h.first, objects };
+      offset += objects;
+      h.segments[h.n_segments++] = (struct mem_image_segment) {
+	offset, h.first + pairs, end - pairs };
+      offset += end - pairs;
+    }
+
+  for (int i = 0; i < h.n_segments; i++)
+    mem_image_write (f, h.segments[i].offset,
+		     val_ptr (h.segments[i].addr, 0), h.segments[i].size);
+
+  /* Each large object is preceded by its address and size.
+   */
+  h.large_offset = offset;
+  for (struct mem_large *l = mem_large_objs; l; l = l->next)
+    {
+      word info[2] = { val_ptr_make (l->obj, 0), l->size };
+      mem_image_write (f, offset, info, sizeof (info));
+      mem_image_write (f, offset + sizeof (info), l->obj,
+		       l->size*sizeof (val));
+      offset += sizeof (info) + l->size*sizeof (val);
+      h.n_large++;
+    }
+
+  h.hash_offset = offset;
+  h.n_hashes = mem_hash_n;
+  h.hash_counter = mem_hash_counter;
+  mem_image_write (f, offset, mem_hashes,
+		   mem_hash_n * sizeof (struct mem_hash_entry));
+  offset += mem_hash_n * sizeof (struct mem_hash_entry);
+
+  h.sym_offset = offset;
+  h.n_syms = sym_n;
+  for (word i = 0; i < sym_n; i++)
+    {
+      mem_image_write (f, offset, &sym_names[i].len, sizeof (word));
+      mem_image_write (f, offset + sizeof (word), sym_names[i].bytes,
+		       sym_names[i].len);
+      offset += sizeof (word) + sym_names[i].len;
+    }
+
+  mem_image_write (f, 0, &h, sizeof (h));
+  for (int i = 0; i < mem_n_roots; i++)
+    mem_image_write (f, sizeof (h) + i*sizeof (val), mem_roots[i],
+		     sizeof (val));
+
+  if (fclose (f) != 0)
+    {
+      printf ("can't write %s\n", mem_dump_image_name);
+      mem_image_dump_fail ();
+    }
+}
+
+/* Map the image as the permanent space, at its old addresses.
+ */
+
+bool
+mem_perm_map ()
+{
+  struct mem_image_header *h = &mem_image;
+  int i;
+
+#ifdef VAL_COMPRESSED
+  return false;
+#endif
+
+  if (h->n_large > 0)
+    return false;
+
+  for (i = 0; i < h->n_segments; i++)
+    {
+      struct mem_image_segment *s = &h->segments[i];
+      void *addr = (void *)(unsigned long)s->addr;
+      void *p = mmap (addr, s->size, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_FIXED_NOREPLACE,
+		      fileno (mem_image_file), s->offset);
+      if (p != addr)
+	{
+	  if (p != MAP_FAILED)
+	    munmap (p, s->size);
+	  break;
+	}
+    }
+
+  if (i < h->n_segments)
+    {
+      while (--i >= 0)
+	munmap ((void *)(unsigned long)h->segments[i].addr,
+		h->segments[i].size);
+      return false;
+    }
+
+  mem_perm.first = (val *)(unsigned long)h->first;
+  mem_perm.next = (val *)(unsigned long)h->next;
+  mem_perm.pairs = (val *)(unsigned long)h->pairs;
+  mem_perm.end = (val *)(unsigned long)h->end;
+
+  word n = (mem_perm.end - mem_perm.first + 31) / 32;
+  mem_perm_bits = calloc (n, sizeof (word));
+  if (mem_perm_bits == NULL)
+    abort ();
+
+  return true;
+}
+
+/* A file that is shorter than its header says, or that isn't an image
+   at all, is reported like a missing one.  The header is checked
+   against the size of the file before anything is mapped from it or
+   allocated for it.
+*/
+
+word mem_image_size;
+
+void
+mem_image_fail ()
+{
+  printf ("can't load %s\n", mem_image_name);
+  exit (1);
+}
+
+void
+mem_image_read (void *buf, size_t size, word n)
 {
-  sword size;
-  val *ptr, *new_ptr;
+  if (fread (buf, size, n, mem_image_file) != n)
+    mem_image_fail ();
+}
 
-  if (!val_ptr_p (v))
-    return v;
+void
+mem_image_seek (word offset)
+{
+  if (fseek (mem_image_file, offset, SEEK_SET) != 0)
+    mem_image_fail ();
+}
 
-  ptr = val_ptr_any_tag (v);
+/* Whether N items of SIZE bytes fit into the file after OFFSET.
+ */
 
-  /* If we find a forwarding pointer, we just follow it.
-   */
-  new_ptr = mem_follow_fwd_ptr (ptr);
-  if (new_ptr != ptr)
-    return val_ptr_make (new_ptr, val_tag (v, 3));
-
-  if (pair_ptr_p (ptr))
-    size = 2;
-  else if (vec_ptr_p (ptr))
-    size = vec_ptr_len (ptr) + 1;
-  else if (bytev_ptr_p (ptr))
-    size = (bytev_ptr_len (ptr) + 3) / 4 + 1;
-  else if (code_ptr_p (ptr))
-    size += code_ptr_lit_end (ptr) + 1;
-  else if (rec_ptr_p (ptr))
+bool
+mem_image_fits (word offset, word n, word size)
+{
+  return offset <= mem_image_size && n <= (mem_image_size - offset) / size;
+}
+
+bool
+mem_image_valid ()
+{
+  struct mem_image_header *h = &mem_image;
+
+  if (memchr (h->magic, 0, sizeof (h->magic)) == NULL
+      || strcmp (h->magic, MEM_IMAGE_MAGIC) != 0)
+    return false;
+
+  if (fseek (mem_image_file, 0, SEEK_END) != 0)
+    return false;
+  long size = ftell (mem_image_file);
+  if (size < 0 || (unsigned long)size != (word)size)
+    return false;
+  mem_image_size = size;
+
+  if (h->first > h->next || h->next > h->pairs || h->pairs > h->end
+      || h->first % sizeof (val) != 0 || h->end % sizeof (val) != 0
+      || h->max_size > ((word)-1 >> 3)
+      || (h->end - h->first) / sizeof (val) > h->max_size
+      || h->n_segments < 1 || h->n_segments > 2
+      || h->n_large < 0 || h->n_roots < 0 || h->n_hashes < 0)
+    return false;
+
+  /* The segments are mapped with MAP_FIXED, so they must lie within
+     the pages of the space, which are within its slot.  The first one
+     starts with the objects, and the last one ends with the pairs.
+  */
+  word page = getpagesize ();
+  word space = mem_page_round (h->end - h->first);
+  for (int i = 0; i < h->n_segments; i++)
     {
-      /* The descriptor might have already been copied and thus we
-	 might find a forwarding pointer in its place.
-      */
-      val *desc_ptr = mem_follow_fwd_ptr (val_ptr(rec_ptr_desc (ptr),3));
-      size = abs (fixnum_num (desc_ptr[1])) + 1;
+      struct mem_image_segment *s = &h->segments[i];
+      word start = s->addr - h->first;
+      if (!mem_image_fits (s->offset, s->size, 1)
+	  || s->offset % page != 0 || s->addr < h->first
+	  || start % page != 0 || start > space || s->size > space - start)
+	return false;
     }
+  struct mem_image_segment *last = &h->segments[h->n_segments - 1];
+  if (h->segments[0].addr != h->first
+      || h->segments[0].size < h->next - h->first
+      || last->addr > h->pairs
+      || last->addr - h->first + last->size != space)
+    return false;
+
+  return (mem_image_fits (sizeof (*h), h->n_roots, sizeof (val))
+	  && mem_image_fits (h->large_offset, h->n_large, 2*sizeof (word))
+	  && mem_image_fits (h->hash_offset, h->n_hashes,
+			     sizeof (struct mem_hash_entry))
+	  && mem_image_fits (h->sym_offset, h->n_syms, sizeof (word)));
+}
+
+/* Read the header of the image before the heap is reserved, so that
+   the heap can be put in the same place as before, or around the
+   permanent space.
+*/
+
+void
+mem_image_open ()
+{
+  mem_image_file = fopen (mem_image_name, "r");
+  if (mem_image_file == NULL
+      || fread (&mem_image, sizeof (mem_image), 1, mem_image_file) != 1
+      || !mem_image_valid ())
+    mem_image_fail ();
+
+  if (mem_image_shared && mem_perm_map ())
+    return;
+
+  mem_size = (mem_image.end - mem_image.first) / sizeof (val);
+  if (mem_max_size < mem_size)
+    mem_max_size = mem_size;
+#ifndef VAL_COMPRESSED
+  if (mem_max_size == mem_image.max_size)
+    mem_reserve_hint = (val *)(unsigned long)mem_image.base;
+#endif
+}
+
+sword mem_image_delta;
+val **mem_image_large;
+
+void
+mem_image_relocate (val *slot)
+{
+  val v = *slot;
+  if (!val_ptr_p (v))
+    return;
+
+  word addr = val_ptr_make (val_ptr_any_tag (v), 0);
+  if (addr >= mem_image.first && addr < mem_image.end)
+    *slot = v + mem_image_delta*sizeof (val);
   else
-    abort ();
+    {
+      val *ptr = val_ptr (addr, 0);
+      for (int i = 0; i < mem_image.n_large; i++)
+	if (mem_image_large[2*i] == ptr)
+	  {
+	    *slot = val_ptr_make (mem_image_large[2*i + 1], val_tag (v, 3));
+	    return;
+	  }
+      mem_image_fail ();
+    }
+}
 
-  new_ptr = mem_new_next;
-  mem_new_next += (size+1)&~1;
+/* The descriptor of a record is needed to find its fields, so it is
+   relocated first.
+*/
 
-  memcpy (new_ptr, ptr, size*sizeof(word));
-  mem_install_fwd_ptr (ptr, new_ptr);
+void
+mem_image_relocate_obj (val *ptr)
+{
+  val *end;
 
-  return val_ptr_make (new_ptr, val_tag (v, 3));
+  if (rec_ptr_p (ptr))
+    {
+      val desc = rec_ptr_desc (ptr);
+      mem_image_relocate (&desc);
+      ptr[0] = rec_header_make (desc);
+    }
+  for (val *f = mem_obj_fields (ptr, &end); f < end; f++)
+    mem_image_relocate (f);
 }
 
-val *
-mem_scan (val *ptr)
+/* Map the objects of the image into the old generation, using the
+   slot that the image was written from when the heap is in the same
+   place, and read its large objects.
+*/
+
+void
+mem_image_load_old ()
 {
-  sword size;
+  FILE *f = mem_image_file;
+  struct mem_image_header *h = &mem_image;
 
-  val *orig = ptr;
+  int slot = val_ptr_make (mem_slots[1], 0) == h->first;
+  mem_space_free (&mem_old);
+#ifndef GC_CONSERVATIVE
+  mem_space_free (&mem_spare);
+#endif
+  mem_slot_used[slot] = true;
+  mem_slot_mapped[slot] = true;
+  mem_space_init (&mem_old, mem_slots[slot], mem_size);
+#ifndef GC_CONSERVATIVE
+  mem_space_alloc (&mem_spare, mem_size);
+#endif
 
-  if (pair_ptr_p (ptr))
-      size = 2;
-  else if (vec_ptr_p (ptr))
+  mem_image_delta = mem_old.first - val_ptr (h->first, 0);
+  mem_old.next = val_ptr (h->next, 0) + mem_image_delta;
+  mem_old.pairs = val_ptr (h->pairs, 0) + mem_image_delta;
+
+  for (int i = 0; i < h->n_segments; i++)
     {
-      size = vec_ptr_len (ptr);
-      ptr += 1;
+      struct mem_image_segment *s = &h->segments[i];
+      val *addr = val_ptr (s->addr, 0) + mem_image_delta;
+      if (addr < mem_slots[slot]
+	  || s->size > ((mem_slots[slot] + mem_slot_size - addr)
+			* sizeof (val)))
+	mem_image_fail ();
+      if (mmap (addr, s->size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_FIXED, fileno (f), s->offset) == MAP_FAILED)
+	{
+	  printf ("can't map %s\n", mem_image_name);
+	  exit (1);
+	}
     }
-  else if (bytev_ptr_p (ptr))
+
+  mem_image_large = malloc (2*h->n_large * sizeof (val *));
+  mem_image_seek (h->large_offset);
+  for (int i = 0; i < h->n_large; i++)
     {
-      ptr += (bytev_ptr_len (ptr) + 3) / 4 + 1;
-      size = 0;
+      word info[2];
+      mem_image_read (info, sizeof (info), 1);
+      if (info[1] > mem_image_size / sizeof (val))
+	mem_image_fail ();
+      val *obj = mem_large_new (info[1]);
+      mem_image_read (obj, sizeof (val), info[1]);
+      mem_image_large[2*i] = val_ptr (info[0], 0);
+      mem_image_large[2*i + 1] = obj;
     }
-  else if (code_ptr_p (ptr))
+}
+
+/* Load the image into the old generation, which has been reserved
+   with the size that the image needs, unless it has been mapped as the
+   permanent space already.  Then set the global roots, which have just
+   been registered.
+*/
+
+void
+mem_image_load ()
+{
+  struct mem_image_header *h = &mem_image;
+
+  if (h->n_roots != mem_n_roots)
     {
-      int b = code_ptr_lit_begin (ptr);
-      int e = code_ptr_lit_end (ptr);
-      size = e - b;
-      ptr += b;
+      printf ("%s doesn't fit this program\n", mem_image_name);
+      exit (1);
     }
-  else if (rec_ptr_p (ptr))
+
+  if (mem_perm.first == NULL)
+    mem_image_load_old ();
+
+  mem_image_seek (sizeof (*h));
+  for (int i = 0; i < mem_n_roots; i++)
+    mem_image_read (mem_roots[i], sizeof (val), 1);
+
+  if (mem_perm.first == NULL && (mem_image_delta != 0 || h->n_large > 0))
     {
-      /* We need to copy the descriptor here manually, since it has a
-	 funny tag that the rest of the code doesn't want to see.
-      */
-      val desc = mem_copy (rec_ptr_desc (ptr));
-      ptr[0] = rec_header_make (desc);
-      size = fixnum_num (rec_ptr(desc)[0]);
-      ptr += 1;
-      if (size < 0)
+      for (val *ptr = mem_old.first; ptr < mem_old.next; )
 	{
-	  ptr += size;
-	  size = 0;
+	  mem_image_relocate_obj (ptr);
+	  ptr = mem_align (ptr + mem_obj_size (ptr, ptr[0]));
 	}
+      for (val *ptr = mem_old.pairs; ptr < mem_old.end; ptr++)
+	mem_image_relocate (ptr);
+      for (int i = 0; i < h->n_large; i++)
+	mem_image_relocate_obj (mem_image_large[2*i + 1]);
+      for (int i = 0; i < mem_n_roots; i++)
+	mem_image_relocate (mem_roots[i]);
     }
-  else
-    abort ();
 
-  for (int i = 0; i < size; i++)
-    ptr[i] = mem_copy (ptr[i]);
+  mem_hash_size = mem_hash_n = h->n_hashes;
+  mem_hash_counter = h->hash_counter;
+  mem_hashes = malloc (mem_hash_n * sizeof (struct mem_hash_entry));
+  mem_image_seek (h->hash_offset);
+  mem_image_read (mem_hashes, sizeof (struct mem_hash_entry), mem_hash_n);
+  if (mem_perm.first == NULL && (mem_image_delta != 0 || h->n_large > 0))
+    for (int i = 0; i < mem_hash_n; i++)
+      mem_image_relocate (&mem_hashes[i].obj);
+  mem_hash_rebuild ();
+
+  mem_image_seek (h->sym_offset);
+  for (word i = 0; i < h->n_syms; i++)
+    {
+      word len;
+      mem_image_read (&len, sizeof (word), 1);
+      if (len > mem_image_size)
+	mem_image_fail ();
+      char bytes[len + 1];
+      mem_image_read (bytes, 1, len);
+      if (sym_index (sym_intern (bytes, len)) != i)
+	mem_image_fail ();
+    }
 
-  return (val *)((word)((ptr + size)+1) & ~7);
+  free (mem_image_large);
+  fclose (mem_image_file);
 }
 
-void debug_write (val x);
-void mem_check ();
+/* Background snapshots
+
+   [#@snapshot] writes an image of the heap, like --dump-image does at
+   exit, without stopping the program while the image is written.  It
+   forks, and the child collects its copy of the heap and writes it
+   out, while the parent continues right away on copy-on-write pages.
+   The image goes to the file given with --snapshot or SUO_SNAPSHOT,
+   "suo.snap" by default.  It is written under a temporary name first,
+   so that the file always holds the last complete snapshot, and can be
+   loaded with --image.
+
+   Only the global roots are saved, see 'boot_init'; what the running
+   program holds in its locals is not.  The evaluator keeps its state
+   in the heap, and puts it into a global root for the snapshot, see
+   'Bootstrap evaluator', so that loading the snapshot resumes the
+   evaluation that took it.  One snapshot is taken at a time:
+   [#@snapshot] returns #f while the previous one is still being
+   written, and #t when it has started a new one.  Like --dump-image,
+   it doesn't work on top of a boot image, and always returns #f then.
+
+   The time that the parent spends in 'fork' is the start latency of a
+   snapshot.  While the child runs, the parent measures after each
+   collection how much of its memory has become private again.  That
+   is mostly the pages that it had to copy because it wrote to them,
+   plus the pages that it touched for the first time, and so bounds
+   the extra memory that the snapshot costs.  When the child is done,
+   both numbers are written to the statistics file, and they are also
+   part of [#@gc-stats].
+*/
 
-val *
-mem_gc (int n)
+char *mem_snapshot_name = "suo.snap";
+int mem_n_global_roots;
+
+pid_t mem_snapshot_pid = 0;
+struct timespec mem_snapshot_begin;
+long mem_snapshot_private_base;
+
+unsigned long mem_snapshots = 0;
+unsigned long mem_snapshots_failed = 0;
+long mem_snapshot_start_us = 0;
+long mem_snapshot_extra = 0;
+
+void
+mem_set_snapshot (char *str)
 {
-#ifdef DEBUG
-  mem_check ();
-#endif
+  mem_snapshot_name = str;
+}
 
-  mem_new_first = malloc (mem_size * 4);
-  if (mem_new_first == NULL)
-    abort ();
+long
+mem_snapshot_elapsed ()
+{
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return ((now.tv_sec - mem_snapshot_begin.tv_sec) * 1000000
+	  + (now.tv_nsec - mem_snapshot_begin.tv_nsec) / 1000);
+}
 
-  mem_new_end = mem_new_first + mem_size;
-  mem_new_next = mem_new_first;
+/* The memory that only this process uses, in bytes, or zero when the
+   kernel doesn't tell.
+*/
 
-  for (int i = 0; i < mem_n_roots; i++)
-    *(mem_roots[i]) = mem_copy (*(mem_roots[i]));
+long
+mem_private_bytes ()
+{
+  FILE *f = fopen ("/proc/self/smaps_rollup", "r");
+  char line[128];
+  long total = 0, kb;
+
+  if (f == NULL)
+    return 0;
+  while (fgets (line, sizeof (line), f))
+    if (sscanf (line, "Private_Clean: %ld kB", &kb) == 1
+	|| sscanf (line, "Private_Dirty: %ld kB", &kb) == 1)
+      total += kb*1024;
+  fclose (f);
+  return total;
+}
 
-  val *ptr = mem_new_first;
-  int count = 0;
-  while (ptr < mem_new_next)
-    {
-      ptr = mem_scan (ptr);
-      count++;
-    }
-    
-  free (mem_first);
-  mem_first = mem_new_first;
-  mem_end = mem_new_end;
-  mem_next = mem_new_next;
+/* The child has no collector threads, and doesn't write statistics.
+   It leaves with _exit, also when writing the image fails, so that it
+   doesn't run the atexit handlers of the parent, and doesn't move the
+   offset of the input that it shares with the parent.
+*/
 
-  mem_new_first = NULL;
+void
+mem_snapshot_child ()
+{
+  static char tmp[4096];
+
+  snprintf (tmp, sizeof (tmp), "%s.tmp", mem_snapshot_name);
+  mem_gc_threads = 1;
+  mem_stats_file = NULL;
+  mem_n_roots = mem_n_global_roots;
+  mem_dump_image_name = tmp;
+  mem_dump_in_child = true;
+  mem_image_dump ();
+
+  if (rename (tmp, mem_snapshot_name) != 0)
+    _exit (1);
+  _exit (0);
+}
 
-  dbg ("GC: copied %d objects, %d words (%02f%%)\n",
-       count, mem_next - mem_first, (mem_next - mem_first)*100.0/mem_size);
+bool
+mem_snapshot_start ()
+{
+  mem_snapshot_poll (false);
+  if (mem_snapshot_pid > 0 || mem_perm.first)
+    return false;
 
-  if (mem_new_end - mem_new_next < n)
-    {
-      printf ("FULL\n");
-      abort ();
-    }
+  /* Nothing that is buffered must be written twice.
+   */
+  fflush (NULL);
+
+  clock_gettime (CLOCK_MONOTONIC, &mem_snapshot_begin);
+  pid_t pid = fork ();
+  if (pid == 0)
+    mem_snapshot_child ();
+  if (pid < 0)
+    return false;
+
+  mem_snapshot_pid = pid;
+  mem_snapshot_start_us = mem_snapshot_elapsed ();
+  mem_snapshot_private_base = mem_private_bytes ();
+  mem_snapshot_extra = 0;
+  return true;
+}
 
-#ifdef DEBUG
-  mem_check ();
-#endif
+/* Sample the memory of the parent, and reap the child when it is
+   done, or wait for it when WAIT is true.
+*/
 
-  return mem_next;
+void
+mem_snapshot_poll (bool wait)
+{
+  int status;
+
+  if (mem_snapshot_pid == 0)
+    return;
+
+  long extra = mem_private_bytes () - mem_snapshot_private_base;
+  if (extra > mem_snapshot_extra)
+    mem_snapshot_extra = extra;
+
+  if (waitpid (mem_snapshot_pid, &status, wait? 0 : WNOHANG)
+      != mem_snapshot_pid)
+    return;
+
+  bool ok = WIFEXITED (status) && WEXITSTATUS (status) == 0;
+  mem_snapshot_pid = 0;
+  mem_snapshots++;
+  if (!ok)
+    mem_snapshots_failed++;
+
+  if (mem_stats_file)
+    fprintf (mem_stats_file,
+	     "{\"snapshot\": %lu, \"ok\": %s, \"start_us\": %ld, "
+	     "\"extra_rss\": %ld, \"seconds\": %.3f}\n",
+	     mem_snapshots, ok? "true" : "false", mem_snapshot_start_us,
+	     mem_snapshot_extra, mem_snapshot_elapsed () / 1e6);
 }
 
 /* Checking the heap
    
   To track down devious low-level bugs, it is often helpful to check
   the heap for consistency.  In DEBUG mode, this is done before and
-  after each garbage collection.  Together with the flag that runs the
-  garbage collector before each allocation, this narrows down heap
-  corruptions to a few operations.
+  after each garbage collection.  Together with --gc-stress=1, which
+  runs the garbage collector before each allocation, this narrows down
+  heap corruptions to a few operations.
 */
 
-void
-mem_check ()
-{
-  word *shadow_heap = malloc (mem_size * 4);
+/* Scan a space once to find the starts of all objects.  This is used
+   in the next pass to validate pointer values.  This first pass also
+   checks that records have sensible descriptors.
+*/
 
-  /* Scan the heap once to find the starts of all objects.  This is
-     used in the next pass to validate pointer values.  This first
-     pass also checks that records have sensible descriptors.
-  */
+word *
+mem_check_starts (struct mem_space *s)
+{
+  word *shadow_heap = malloc ((s->end - s->first) * sizeof (word));
 
-  memset (shadow_heap, 0, mem_size *4);
+  memset (shadow_heap, 0, (s->end - s->first) * sizeof (word));
 
-  val *ptr = mem_first;
-  while (ptr < mem_next)
+  val *ptr = s->first;
+  while (ptr < s->next)
     {
       word size;
 
-      if (pair_ptr_p (ptr))
-	{
-	  // printf ("p");
-	  size = 2;
-	}
-      else if (vec_ptr_p (ptr))
-	{
-	  // printf ("v");
-	  size = vec_ptr_len (ptr) + 1;
-	}
+      if (vec_ptr_p (ptr))
+	size = vec_ptr_len (ptr) + 1;
       else if (bytev_ptr_p (ptr))
-	{
-	  // printf ("b");
-	  size = (bytev_ptr_len (ptr) + 3) / 4 + 1;
-	}
+	size = word_count (bytev_ptr_len (ptr)) + 1;
       else if (code_ptr_p (ptr))
-	{
-	  // printf ("c");
-	  size = code_ptr_lit_end (ptr) + 1;
-	}
+	size = code_ptr_lit_end (ptr) + 1;
       else if (rec_ptr_p (ptr))
 	{
 	  val desc = rec_ptr_desc (ptr);
 	  if (!rec_p (desc))
 	    abort ();
-	  size = fixnum_num (rec_ptr (desc)[0]) + 1;
-	  // printf ("r");
+	  size = labs (fixnum_num (rec_ptr (desc)[0])) + 1;
 	}
       else
 	abort ();
 
-      word *shadow = shadow_heap + (ptr - mem_first);
-      shadow_heap[ptr - mem_first] = size;
+      shadow_heap[ptr - s->first] = size;
+
+      ptr = mem_align (ptr + size);
+    }
+
+  for (ptr = s->pairs; ptr < s->end; ptr += 2)
+    shadow_heap[ptr - s->first] = 2;
+
+  return shadow_heap;
+}
+
+word *mem_check_young_starts;
+word *mem_check_old_starts;
+
+/* In the second pass, we check each value in the heap.  Pointer values
+   must point to the start of objects, pairs must be in the pair region
+   of their space, and we must not find headers and record descriptors
+   at all.
+*/
+
+void
+mem_check_value (val v)
+{
+  if (val_ptr_p (v))
+    {
+      val *p = val_ptr_any_tag (v);
+      word s;
+
+      if ((p >= mem_young.first && p < mem_young.next)
+	  || mem_space_pair_p (&mem_young, p))
+	{
+#ifdef GC_CONSERVATIVE
+	  /* A wrapped pair must be inside its vector.
+	   */
+	  if (pair_p (v) && !mem_space_pair_p (&mem_young, p))
+	    p = val_ptr (mem_wrapper (p), 2);
+	  else
+#endif
+	  if (pair_p (v) != mem_space_pair_p (&mem_young, p))
+	    abort ();
+	  s = mem_check_young_starts[p - mem_young.first];
+	}
+      else if ((p >= mem_old.first && p < mem_old.next)
+	       || mem_space_pair_p (&mem_old, p))
+	{
+#ifdef GC_CONSERVATIVE
+	  if (pair_p (v) && !mem_space_pair_p (&mem_old, p))
+	    p = val_ptr (mem_wrapper (p), 2);
+	  else
+#endif
+	  if (pair_p (v) != mem_space_pair_p (&mem_old, p))
+	    abort ();
+	  s = mem_check_old_starts[p - mem_old.first];
+	}
+#ifdef GC_CONSERVATIVE
+      else if (mem_young_p (p) || mem_old_p (p))
+	{
+	  struct mem_pin *in = mem_island_at (mem_young_p (p)
+					      ? &mem_young_islands
+					      : &mem_old_islands, p);
+	  if (in == NULL || in->ptr != p || in->pair != pair_p (v))
+	    abort ();
+	  return;
+	}
+#endif
+      else if (p >= mem_from.first && p < mem_from.end)
+	return;
+      else if (mem_perm_p (p))
+	return;
+      else
+	{
+	  struct mem_large *l;
+	  for (l = mem_large_objs; l; l = l->next)
+	    if (l->obj == p)
+	      return;
+	  abort ();
+	}
+
+      if (s == 0)
+	abort ();
+      // XXX - check for consistent tags and headers
+    }
+  // XXX - check for headers and record descriptors.
+}
 
-      ptr = (val *)((word)((ptr + size)+1) & ~7);
+/* Every pointer from the old generation into the nursery must have
+   been remembered.
+*/
 
-      //printf ("%d ", size);
+void
+mem_check_remembered (val *slot)
+{
+  if (val_ptr_p (*slot) && mem_young_p (val_ptr_any_tag (*slot)))
+    {
+      for (int i = 0; i < mem_remset_n; i++)
+	if (mem_remset[i] == slot)
+	  return;
+      abort ();
     }
-  //printf ("\n");
+}
 
-  /* In the second pass, we check each value in the heap.  Pointer
-     values must point to objects, and we must not find headers and
-     record descriptors at all.
-  */
+/* During an incremental cycle, only unscanned old objects may refer to
+   the from space.
+*/
 
-  ptr = mem_first;
-  while (ptr < mem_next)
+void
+mem_check_not_from (val v)
+{
+  if (val_ptr_p (v)
+      && val_ptr_any_tag (v) >= mem_from.first
+      && val_ptr_any_tag (v) < mem_from.end)
+    abort ();
+}
+
+void
+mem_check_cell (struct mem_space *s, val *ptr)
+{
+  mem_check_value (*ptr);
+  if (s != &mem_young)
+    mem_check_remembered (ptr);
+  else
+    mem_check_not_from (*ptr);
+}
+
+void
+mem_check_refs (struct mem_space *s, word *shadow_heap)
+{
+  val *ptr = s->first;
+  while (ptr < s->next)
     {
-      word size = shadow_heap[ptr - mem_first];
+      word size = shadow_heap[ptr - s->first];
       if (size == 0)
 	abort ();
 
-      val *begin = ptr;
+      val *next = mem_align (ptr + size);
       val *end = ptr + size;
 
-      if (pair_ptr_p (ptr))
-	;
-      else if (vec_ptr_p (ptr))
-	ptr += 1;
+      if (vec_ptr_p (ptr))
+	{
+	  if (flat_ptr_p (ptr))
+	    for (val *f = ptr + 1; f < end; f++)
+	      if (val_ptr_p (*f))
+		abort ();
+	  ptr += 1;
+	}
       else if (bytev_ptr_p (ptr))
 	ptr += size;
       else if (code_ptr_p (ptr))
 	ptr += code_ptr_lit_begin (ptr) + 1;
       else if (rec_ptr_p (ptr))
-	ptr += 1;
+	{
+	  /* The descriptor is checked like a value, but byte records
+	     don't contain anything else.
+	  */
+	  if (fixnum_num (rec_ptr (rec_ptr_desc (ptr))[0]) < 0)
+	    end = ptr + 1;
+	}
       else
 	abort ();
 
-      while (ptr < end)
-	{
-	  val v = *ptr++;
-	  if (val_ptr_p (v))
-	    {
-	      val *p = val_ptr_any_tag (v);
-	      if (p < mem_first || p > mem_end)
-		abort();
-
-	      word s = shadow_heap[p - mem_first];
-	      if (s == 0)
-		abort;
-	      // XXX - check for consistent tags and headers
-	    }
-	  // XXX - check for headers and record descriptors.
-	}
+      for (; ptr < end; ptr++)
+	mem_check_cell (s, ptr);
+
+      ptr = next;
+    }
+
+  for (ptr = s->pairs; ptr < s->end; ptr++)
+    mem_check_cell (s, ptr);
+}
+
+/* Each large object is checked as if it was a space of its own.
+ */
+
+void
+mem_check_large ()
+{
+  for (struct mem_large *l = mem_large_objs; l; l = l->next)
+    {
+      val *end = l->obj + l->size;
+      struct mem_space s = { l->obj, end, end, end };
+      word *shadow_heap = mem_check_starts (&s);
+      if (shadow_heap[0] != l->size)
+	abort ();
+      mem_check_refs (&s, shadow_heap);
+      free (shadow_heap);
+    }
+}
+
+/* Every object in the side table of identity hashes must be found at
+   its own address, and its entry must have moved along with it when it
+   has been copied during an incremental cycle.
+*/
+
+void
+mem_check_hashes ()
+{
+  int young = 0;
+
+  for (int i = 0; i < mem_hash_n; i++)
+    {
+      val v = mem_hashes[i].obj;
+      val *ptr = val_ptr_any_tag (v);
+
+      mem_check_value (v);
+      if (mem_hash_find (ptr) < 0
+	  || mem_hash_index[mem_hash_find (ptr)] != i + 1)
+	abort ();
+      if (ptr >= mem_from.first && ptr < mem_from.end
+	  && mem_to && mem_fwd_ptr_p (ptr[0]))
+	abort ();
+      if (mem_young_p (ptr))
+	young++;
+    }
+
+  if (young != mem_hash_young)
+    abort ();
+}
+
+void
+mem_check ()
+{
+  mem_check_young_starts = mem_check_starts (&mem_young);
+  mem_check_old_starts = mem_check_starts (&mem_old);
+
+  mem_check_refs (&mem_young, mem_check_young_starts);
+  mem_check_refs (&mem_old, mem_check_old_starts);
+  mem_check_large ();
 
-      ptr = (val *)((word)((end)+1) & ~7);
+  for (int i = 0; i < mem_n_roots; i++)
+    {
+      mem_check_value (*(mem_roots[i]));
+      mem_check_not_from (*(mem_roots[i]));
+    }
+  for (int i = 0; i < mem_perm_n; i++)
+    {
+      mem_check_value (*(mem_perm_slots[i]));
+      mem_check_not_from (*(mem_perm_slots[i]));
     }
+  mem_check_hashes ();
 
-  free (shadow_heap);
+  free (mem_check_young_starts);
+  free (mem_check_old_starts);
 }
 
 
@@ -949,12 +6252,41 @@ mem_check ()
 
    Global variables need to be protected, too.  This is done by
    allocating the first few entries in the stack for them, by calling
-   GC_PROTECT outside of any GC_BEGIN/GC_END pair.
+   GC_PROTECT_GLOBAL outside of any GC_BEGIN/GC_END pair.
+
+   The stack grows as needed, so there is no limit on the number of
+   protected variables.  In DEBUG mode, GC_END checks that the scopes
+   are properly nested: an inner scope that is left without GC_END
+   makes the stack shrink below the start of the outer one.
+
+   With conservative roots, the collector finds the local variables on
+   its own, and only the global variables are protected, with
+   GC_PROTECT_GLOBAL.  The other macros do nothing then.
 */
 
+#define GC_PROTECT_GLOBAL(var)  mem_protect (&(var))
+
+#ifdef GC_CONSERVATIVE
+#define GC_BEGIN         do { } while (0)
+#define GC_PROTECT(var)  do { } while (0)
+#define GC_END           do { } while (0)
+#else
+
 #define GC_BEGIN         int __gc_start = mem_n_roots
-#define GC_PROTECT(var)  mem_roots[mem_n_roots++] = &(var)
+#define GC_PROTECT(var)  mem_protect (&(var))
+
+#ifdef DEBUG
+#define GC_END							\
+  do {								\
+    if (mem_n_roots < __gc_start)				\
+      abort ();							\
+    mem_n_roots = __gc_start;					\
+  } while (0)
+#else
 #define GC_END           mem_n_roots = __gc_start
+#endif
+
+#endif /* !GC_CONSERVATIVE */
 
 /* Bootstrap primitives
 
@@ -964,62 +6296,82 @@ mem_check ()
 
 val boot_record_type_type = nil;
 val boot_string_type = nil;
-val boot_symbol_type = nil;
 val boot_function_type = nil;
-
-val boot_symbols = nil;
+val boot_bignum_type = nil;
 
 val boot_dot_token = nil;
 
+/* The evaluation that was running when the heap was snapshotted, see
+   'boot_eval'.
+*/
+
+val boot_resume = nil;
+
 val
 car (val v)
 {
-  return pair_ptr(v)[0];
+  return mem_read_barrier (&pair_ptr(v)[0]);
 }
 
 val
 cdr (val v)
 {
-  return pair_ptr(v)[1];
+  return mem_read_barrier (&pair_ptr(v)[1]);
 }
 
 void
 set_car (val v, val x)
 {
   pair_ptr(v)[0] = x;
+  mem_write_barrier (&pair_ptr(v)[0], x);
 }
 
 void
 set_cdr (val v, val x)
 {
   pair_ptr(v)[1] = x;
+  mem_write_barrier (&pair_ptr(v)[1], x);
 }
 
+/* Most of the time, a pair can be allocated without collecting, and A
+   and D don't need to be protected.  A new pair is always young, so
+   its fields don't need the write barrier either.
+*/
+
 val
 cons (val a, val d)
 {
-  GC_BEGIN;
-  GC_PROTECT (a);
-  GC_PROTECT (d);
+  val *ptr = mem_alloc_pair_fast ();
 
-  val v = pair_alloc ();
-  set_car (v, a);
-  set_cdr (v, d);
-  
-  GC_END;
-  return v;
+  if (ptr == NULL)
+    {
+      GC_BEGIN;
+      GC_PROTECT (a);
+      GC_PROTECT (d);
+      ptr = mem_alloc_pair ();
+      GC_END;
+    }
+
+  ptr[0] = a;
+  ptr[1] = d;
+  return val_ptr_make (ptr, 1);
 }
 
 val
 vec_ref (val v, int i)
 {
-  return vec_ptr(v)[i];
+  return mem_read_barrier (&vec_ptr(v)[i]);
 }
 
 void
 vec_set (val v, int i, val x)
 {
+#ifdef DEBUG
+  if (val_ptr_p (x) && flat_ptr_p (val_ptr (v, 2)))
+    abort ();
+#endif
   vec_ptr(v)[i] = x;
+  mem_write_barrier (&vec_ptr(v)[i], x);
 }
 
 val
@@ -1036,6 +6388,167 @@ vec_make (word len, val init)
   return v;
 }
 
+val
+weak_make (word len, val init)
+{
+  GC_BEGIN;
+  GC_PROTECT (init);
+
+  val v = weak_alloc (len);
+  for (int i = 0; i < len; i++)
+    vec_set (v, i, init);
+
+  GC_END;
+  return v;
+}
+
+val
+flat_make (word len, val init)
+{
+  val v = flat_alloc (len);
+  for (int i = 0; i < len; i++)
+    vec_set (v, i, init);
+  return v;
+}
+
+val
+eph_make (word n, val init)
+{
+  GC_BEGIN;
+  GC_PROTECT (init);
+
+  val v = eph_alloc (n);
+  for (int i = 0; i < 2*n; i++)
+    vec_set (v, i, init);
+
+  GC_END;
+  return v;
+}
+
+/* An ephemeron table maps keys to values, and keeps each value alive
+   only as long as its key is alive anyway.  It is a vector with an
+   ephemeron vector of a power of two pairs in it, and the number of
+   its pairs that have ever been used.  Keys are compared with 'eq',
+   and are found by linear probing from the pair that their identity
+   hash chooses, see 'Identity hashes'.  Hashes don't change when the
+   collector moves keys, so the table never needs to be rehashed after
+   a collection.
+
+   A key of 'unspecified' marks a free pair, and probing stops there.
+   The collector leaves a key of #f behind for a dead key, and probing
+   goes on past those.  Thus, neither value can be a key itself; such a
+   key is never found, and must not be stored.  When three quarters of
+   the pairs have been used, the living ones are moved into a fresh
+   ephemeron vector.
+*/
+
+val
+etab_make ()
+{
+  GC_BEGIN;
+  val e = eph_make (4, unspec);
+  GC_PROTECT (e);
+  val t = vec_make (2, fixnum_make (0));
+  vec_set (t, 0, e);
+  GC_END;
+  return t;
+}
+
+word
+etab_find (val e, val key)
+{
+  word mask = vec_len (e)/2 - 1;
+  word i = mem_hash (key) & mask;
+
+  while (1)
+    {
+      val k = vec_ref (e, 2*i);
+      if (k == key || k == unspec)
+	return i;
+      i = (i + 1) & mask;
+    }
+}
+
+val
+etab_ref (val t, val key, val def)
+{
+  if (key == unspec || key == bool_f)
+    return def;
+
+  val e = vec_ref (t, 0);
+  word i = etab_find (e, key);
+  if (vec_ref (e, 2*i) == key)
+    return vec_ref (e, 2*i+1);
+  return def;
+}
+
+void
+etab_grow (val t)
+{
+  GC_BEGIN;
+  GC_PROTECT (t);
+
+  val e = vec_ref (t, 0);
+  word n = vec_len (e)/2, live = 0;
+  for (word i = 0; i < n; i++)
+    if (vec_ref (e, 2*i) != unspec && vec_ref (e, 2*i) != bool_f)
+      live++;
+
+  word size = 4;
+  while (4*(live + 1) > 3*size)
+    size *= 2;
+
+  val f = eph_make (size, unspec);
+  e = vec_ref (t, 0);
+  for (word i = 0; i < n; i++)
+    {
+      val k = vec_ref (e, 2*i);
+      if (k != unspec && k != bool_f)
+	{
+	  word j = etab_find (f, k);
+	  vec_set (f, 2*j, k);
+	  vec_set (f, 2*j+1, vec_ref (e, 2*i+1));
+	}
+    }
+
+  vec_set (t, 0, f);
+  vec_set (t, 1, fixnum_make (live));
+  GC_END;
+}
+
+void
+etab_set (val t, val key, val x)
+{
+  if (key == unspec || key == bool_f)
+    abort ();
+
+  val e = vec_ref (t, 0);
+  word i = etab_find (e, key);
+
+  if (vec_ref (e, 2*i) == key)
+    {
+      vec_set (e, 2*i+1, x);
+      return;
+    }
+
+  word used = fixnum_num (vec_ref (t, 1));
+  if (4*(used + 1) > 3*(vec_len (e)/2))
+    {
+      GC_BEGIN;
+      GC_PROTECT (t);
+      GC_PROTECT (key);
+      GC_PROTECT (x);
+      etab_grow (t);
+      GC_END;
+      etab_set (t, key, x);
+      return;
+    }
+
+  vec_set (e, 2*i, key);
+  vec_set (e, 2*i+1, x);
+  vec_set (t, 1, fixnum_make (used + 1));
+}
+
 unsigned char
 bytev_ref_u8 (val v, int i)
 {
@@ -1051,13 +6564,14 @@ bytev_set_u8 (val v, int i, unsigned char x)
 val
 rec_ref (val v, int i)
 {
-  return rec_ptr(v)[i];
+  return mem_read_barrier (&rec_ptr(v)[i]);
 }
 
 val
 rec_set (val v, int i, val x)
 {
   rec_ptr(v)[i] = x;
+  mem_write_barrier (&rec_ptr(v)[i], x);
 }
 
 int
@@ -1083,57 +6597,464 @@ rec_make (val type, ...)
       GC_PROTECT (f[i]);
     }
 
-  val v = rec_alloc (n);
-  rec_set_desc (v, type);
-  for (int i = 0; i < n; i++)
-    rec_set (v, i, f[i]);
+  val v = rec_alloc (n);
+  rec_set_desc (v, type);
+  for (int i = 0; i < n; i++)
+    rec_set (v, i, f[i]);
+
+  GC_END;
+  return v;
+}
+
+val
+string_make (char *str)
+{
+  int n = strlen (str);
+  val b = bytev_alloc (n);
+  memcpy (bytev_ptr (b, char *), str, n);
+  return rec_make (boot_string_type, b);
+}
+
+val
+intern (char *str)
+{
+  return sym_intern (str, strlen (str));
+}
+
+/* Big integers
+
+   Integers that don't fit into a small integer are 'bignums', records
+   with a byte vector of 32 bit digits, least significant first, and a
+   sign, which is #t for negative numbers.  The digits have no leading
+   zeros, and a bignum never holds a number that would fit into a
+   small integer, so every integer has exactly one representation.
+
+   The arithmetic works on a 'struct big' with malloced digits, and
+   only allocates in the heap when the result is turned back into a
+   value.  Thus, the bignum code doesn't need to protect anything.
+
+   Multiplication uses Karatsuba's method when both factors have at
+   least BIG_KARATSUBA digits: with A = A1 B^M + A0 and B = B1 B^M +
+   B0, the middle part A1 B0 + A0 B1 is (A0 + A1)(B0 + B1) - A0 B0 -
+   A1 B1, and only three half size products are needed instead of
+   four.
+*/
+
+#define BIG_KARATSUBA 32
+
+struct big {
+  bool neg;
+  word len;
+  uint32_t *dig;
+};
+
+bool
+big_p (val v)
+{
+  return rec_p (v) && rec_desc (v) == boot_bignum_type;
+}
+
+uint32_t *
+big_digits_alloc (word n)
+{
+  return calloc (n + 1, sizeof (uint32_t));
+}
+
+void
+big_free (struct big *b)
+{
+  free (b->dig);
+}
+
+void
+big_trim (struct big *b)
+{
+  while (b->len > 0 && b->dig[b->len-1] == 0)
+    b->len--;
+  if (b->len == 0)
+    b->neg = false;
+}
+
+void
+big_from_sword (struct big *b, sword x)
+{
+  uint64_t m = x < 0? -(uint64_t)x : (uint64_t)x;
+
+  b->neg = x < 0;
+  b->len = 0;
+  b->dig = big_digits_alloc (2);
+  while (m)
+    {
+      b->dig[b->len++] = m;
+      m >>= 32;
+    }
+}
+
+void
+big_from_val (struct big *b, val v)
+{
+  if (fixnum_p (v))
+    big_from_sword (b, fixnum_num (v));
+  else if (big_p (v))
+    {
+      val bytes = rec_ref (v, 0);
+      b->neg = rec_ref (v, 1) != bool_f;
+      b->len = bytev_len (bytes) / sizeof (uint32_t);
+      b->dig = big_digits_alloc (b->len);
+      memcpy (b->dig, bytev_ptr (bytes, uint32_t), bytev_len (bytes));
+    }
+  else
+    abort ();
+}
+
+/* Turn B into a small integer when it fits, or into a bignum, and
+   free it.
+*/
+
+val
+big_to_val (struct big *b)
+{
+  big_trim (b);
+
+  if (b->len <= 2)
+    {
+      uint64_t m = b->len > 1? ((uint64_t)b->dig[1] << 32) | b->dig[0]
+	: b->len > 0? b->dig[0] : 0;
+      if (m <= (uint64_t)fixnum_max + b->neg)
+	{
+	  big_free (b);
+	  return fixnum_make (b->neg? -(sword)m : (sword)m);
+	}
+    }
+
+  val bytes = bytev_alloc (b->len * sizeof (uint32_t));
+  memcpy (bytev_ptr (bytes, uint32_t), b->dig, b->len * sizeof (uint32_t));
+  bool neg = b->neg;
+  big_free (b);
+  return rec_make (boot_bignum_type, bytes, neg? bool_t : bool_f);
+}
+
+/* The double nearest to B, or an infinity.  The 64 highest bits,
+   starting with a one, are converted together, and the lowest of them
+   is set when any bit below is, so that the conversion still rounds
+   correctly.
+*/
+
+double
+big_to_double (struct big *b)
+{
+  word n = b->len;
+
+  if (n <= 2)
+    {
+      uint64_t m = n > 1? ((uint64_t)b->dig[1] << 32) | b->dig[0]
+	: n > 0? b->dig[0] : 0;
+      return b->neg? -(double)m : (double)m;
+    }
+
+  uint32_t hi = b->dig[n-1], mid = b->dig[n-2], lo = b->dig[n-3];
+  int shift = __builtin_clz (hi);
+  uint64_t m = ((uint64_t)hi << (32 + shift)) | ((uint64_t)mid << shift);
+  bool sticky = false;
+
+  if (shift > 0)
+    {
+      m |= lo >> (32 - shift);
+      sticky = (lo << shift) != 0;
+    }
+  else
+    sticky = lo != 0;
+  for (word i = 0; i < n-3 && !sticky; i++)
+    sticky = b->dig[i] != 0;
+  if (sticky)
+    m |= 1;
+
+  double d = m;
+  int e = 32*(n-2) - shift;
+  for (; e >= 32; e -= 32)
+    d *= 4294967296.0;
+  d *= (double)((uint64_t)1 << e);
+  return b->neg? -d : d;
+}
+
+/* D rounded towards zero, as an integer.  D must be finite.
+ */
+
+val
+big_from_double (double d)
+{
+  struct big b;
+  double x = d < 0? -d : d;
+  double scale = 1;
+  word n = 1;
+
+  while (x >= scale*4294967296.0)
+    {
+      scale *= 4294967296.0;
+      n++;
+    }
+
+  b.neg = d < 0;
+  b.len = n;
+  b.dig = big_digits_alloc (n);
+  for (word i = n; i-- > 0; scale /= 4294967296.0)
+    {
+      uint32_t digit = x / scale;
+      b.dig[i] = digit;
+      x -= digit*scale;
+    }
+
+  return big_to_val (&b);
+}
+
+/* Add the AN digits at A to the RN digits at R, and return the carry
+   out of R.  AN must not be larger than RN.
+*/
+
+uint32_t
+big_add_to (uint32_t *r, word rn, uint32_t *a, word an)
+{
+  uint64_t carry = 0;
+  for (word i = 0; i < rn && (i < an || carry); i++)
+    {
+      carry += (uint64_t)r[i] + (i < an? a[i] : 0);
+      r[i] = carry;
+      carry >>= 32;
+    }
+  return carry;
+}
+
+/* Subtract the AN digits at A from the RN digits at R, which must not
+   be smaller.
+*/
+
+void
+big_sub_from (uint32_t *r, word rn, uint32_t *a, word an)
+{
+  int64_t borrow = 0;
+  for (word i = 0; i < rn && (i < an || borrow); i++)
+    {
+      int64_t t = (int64_t)r[i] - (i < an? a[i] : 0) - borrow;
+      r[i] = t;
+      borrow = t < 0;
+    }
+}
+
+int
+big_cmp_digits (uint32_t *a, word an, uint32_t *b, word bn)
+{
+  if (an != bn)
+    return an < bn? -1 : 1;
+  for (word i = an; i-- > 0;)
+    if (a[i] != b[i])
+      return a[i] < b[i]? -1 : 1;
+  return 0;
+}
+
+/* Store the AN + BN digits of A times B at R, which must not overlap
+   with A or B.
+*/
+
+void
+big_mul_digits (uint32_t *r, uint32_t *a, word an, uint32_t *b, word bn)
+{
+  if (an < bn)
+    {
+      uint32_t *t = a; a = b; b = t;
+      word tn = an; an = bn; bn = tn;
+    }
+
+  if (bn < BIG_KARATSUBA)
+    {
+      memset (r, 0, (an + bn)*sizeof (uint32_t));
+      for (word j = 0; j < bn; j++)
+	{
+	  uint64_t carry = 0;
+	  for (word i = 0; i < an; i++)
+	    {
+	      carry += (uint64_t)a[i]*b[j] + r[i+j];
+	      r[i+j] = carry;
+	      carry >>= 32;
+	    }
+	  r[an+j] = carry;
+	}
+      return;
+    }
+
+  /* A0 has M digits, and A1 has the rest, which is not more.  When B
+     is not longer than A0, we just split A.
+  */
+  word m = (an + 1)/2;
+
+  if (bn <= m)
+    {
+      uint32_t *t = big_digits_alloc (an - m + bn);
+      big_mul_digits (r, a, m, b, bn);
+      memset (r + m + bn, 0, (an - m)*sizeof (uint32_t));
+      big_mul_digits (t, a + m, an - m, b, bn);
+      big_add_to (r + m, an + bn - m, t, an - m + bn);
+      free (t);
+      return;
+    }
+
+  word sn = m + 1;
+  uint32_t *sa = big_digits_alloc (sn);
+  uint32_t *sb = big_digits_alloc (sn);
+  uint32_t *z1 = big_digits_alloc (2*sn);
+
+  big_mul_digits (r, a, m, b, m);
+  big_mul_digits (r + 2*m, a + m, an - m, b + m, bn - m);
+
+  memcpy (sa, a, m*sizeof (uint32_t));
+  sa[m] = big_add_to (sa, m, a + m, an - m);
+  memcpy (sb, b, m*sizeof (uint32_t));
+  sb[m] = big_add_to (sb, m, b + m, bn - m);
+  big_mul_digits (z1, sa, sn, sb, sn);
+  big_sub_from (z1, 2*sn, r, 2*m);
+  big_sub_from (z1, 2*sn, r + 2*m, an + bn - 2*m);
+
+  /* The middle part is less than B^(AN+1), and its higher digits are
+     zero.
+  */
+  word zn = 2*sn < an + bn - m? 2*sn : an + bn - m;
+  big_add_to (r + m, an + bn - m, z1, zn);
 
-  GC_END;
-  return v;
+  free (sa);
+  free (sb);
+  free (z1);
 }
 
-val
-string_make (char *str)
+void
+big_add (struct big *a, struct big *b)
 {
-  int n = strlen (str);
-  val b = bytev_alloc (n);
-  memcpy (bytev_ptr (b, char *), str, n);
-  return rec_make (boot_string_type, b);
+  if (a->neg == b->neg)
+    {
+      word n = (a->len > b->len? a->len : b->len) + 1;
+      uint32_t *d = big_digits_alloc (n);
+      memcpy (d, a->dig, a->len*sizeof (uint32_t));
+      big_add_to (d, n, b->dig, b->len);
+      free (a->dig);
+      a->dig = d;
+      a->len = n;
+    }
+  else if (big_cmp_digits (a->dig, a->len, b->dig, b->len) >= 0)
+    big_sub_from (a->dig, a->len, b->dig, b->len);
+  else
+    {
+      uint32_t *d = big_digits_alloc (b->len);
+      memcpy (d, b->dig, b->len*sizeof (uint32_t));
+      big_sub_from (d, b->len, a->dig, a->len);
+      free (a->dig);
+      a->dig = d;
+      a->len = b->len;
+      a->neg = b->neg;
+    }
+  big_trim (a);
 }
 
-int
-string_eq (val a, char *b)
+void
+big_mul (struct big *a, struct big *b)
 {
-  val bytes = rec_ref (a, 0);
-  return (bytev_len (bytes) == strlen (b)
-	  && memcmp (bytev_ptr (bytes, char *), b, bytev_len (bytes)) == 0);
+  word n = a->len + b->len;
+  uint32_t *d = big_digits_alloc (n);
+  big_mul_digits (d, a->dig, a->len, b->dig, b->len);
+  free (a->dig);
+  a->dig = d;
+  a->len = n;
+  a->neg = a->neg != b->neg;
+  big_trim (a);
 }
 
+/* The decimal digits from PTR to END, in chunks of nine.
+ */
+
 val
-intern (char *str)
+big_read (char *ptr, char *end, bool neg)
 {
-  val s = string_make (str);
-  return rec_make (boot_symbol_type, s);
+  struct big b;
+
+  b.neg = neg;
+  b.len = 0;
+  b.dig = big_digits_alloc ((end - ptr)/9 + 1);
+  while (ptr < end)
+    {
+      uint32_t mul = 1, add = 0;
+      for (int k = 0; k < 9 && ptr < end; k++, ptr++)
+	{
+	  mul *= 10;
+	  add = 10*add + (*ptr - '0');
+	}
+
+      uint64_t carry = add;
+      for (word i = 0; i < b.len; i++)
+	{
+	  carry += (uint64_t)b.dig[i]*mul;
+	  b.dig[i] = carry;
+	  carry >>= 32;
+	}
+      if (carry)
+	b.dig[b.len++] = carry;
+    }
+
+  return big_to_val (&b);
 }
 
-val
-symbol_name (val sym)
+void
+big_write (val x)
 {
-  return rec_ref (sym, 0);
+  struct big b;
+
+  big_from_val (&b, x);
+  if (b.neg)
+    printf ("-");
+
+  uint32_t *chunks = big_digits_alloc (2*b.len);
+  word n = 0;
+  while (b.len > 0)
+    {
+      uint64_t rem = 0;
+      for (word i = b.len; i-- > 0;)
+	{
+	  rem = (rem << 32) | b.dig[i];
+	  b.dig[i] = rem / 1000000000;
+	  rem %= 1000000000;
+	}
+      chunks[n++] = rem;
+      big_trim (&b);
+    }
+
+  if (n == 0)
+    chunks[n++] = 0;
+  printf ("%u", (unsigned)chunks[n-1]);
+  for (word i = n - 1; i-- > 0;)
+    printf ("%09u", (unsigned)chunks[i]);
+
+  free (chunks);
+  big_free (&b);
 }
 
 /* Bootstrap initialisation
+
+   The global variables are always registered in the same order, and
+   when starting from a heap image, they get their values from it.
  */
 
 void
 boot_init ()
 {
-  GC_PROTECT (boot_record_type_type);
-  GC_PROTECT (boot_string_type);
-  GC_PROTECT (boot_symbol_type);
-  GC_PROTECT (boot_function_type);
-  GC_PROTECT (boot_symbols);
-  GC_PROTECT (boot_dot_token);
+  GC_PROTECT_GLOBAL (boot_record_type_type);
+  GC_PROTECT_GLOBAL (boot_string_type);
+  GC_PROTECT_GLOBAL (boot_function_type);
+  GC_PROTECT_GLOBAL (boot_bignum_type);
+  GC_PROTECT_GLOBAL (boot_dot_token);
+  GC_PROTECT_GLOBAL (boot_resume);
+  mem_n_global_roots = mem_n_roots;
+
+  if (mem_image_name)
+    {
+      mem_image_load ();
+      return;
+    }
 
   boot_record_type_type = rec_alloc (2);
   rec_set_desc (boot_record_type_type, boot_record_type_type);
@@ -1144,15 +7065,13 @@ boot_init ()
 			       fixnum_make (1),
 			       nil);
 
-  boot_symbol_type = rec_make (boot_record_type_type,
-			       fixnum_make (1),
-			       nil);
-  
   boot_function_type = rec_make (boot_record_type_type,
 				 fixnum_make (2),
 				 nil);
 
-  boot_symbols = vec_make (511, nil);
+  boot_bignum_type = rec_make (boot_record_type_type,
+			       fixnum_make (2),
+			       nil);
 
   boot_dot_token = string_make ("{dot token}");
 
@@ -1162,10 +7081,10 @@ boot_init ()
   rec_set (boot_record_type_type, 1, x);
   x = intern ("string");
   rec_set (boot_string_type, 1, x);
-  x = intern ("symbol");
-  rec_set (boot_symbol_type, 1, x);
   x = intern ("function");
   rec_set (boot_function_type, 1, x);
+  x = intern ("bignum");
+  rec_set (boot_bignum_type, 1, x);
 }
 
 /* Bootstrap writer
@@ -1198,15 +7117,65 @@ boot_write_push (val stack, val x, int i)
 const char *boot_read_whitespace = " \t\n";
 const char *boot_read_delimiters = "()[]{}';";
 
+#ifdef VAL_NAN
+
+/* Doubles are written with as few digits as read back the same, and
+   always with a dot or an exponent, so that they don't read back as
+   small integers.  Integral doubles below 10^17 are written without an
+   exponent, which only adds digits, and thus still reads back the
+   same.
+*/
+
+void
+boot_write_flo (double d)
+{
+  char buf[32];
+
+  for (int prec = 1; prec <= 17; prec++)
+    {
+      snprintf (buf, sizeof (buf), "%.*g", prec, d);
+      if (strtod (buf, NULL) == d)
+	break;
+    }
+  char *e = strchr (buf, 'e');
+  if (e && atoi (e + 1) >= 0 && atoi (e + 1) < 17)
+    snprintf (buf, sizeof (buf), "%.*g", atoi (e + 1) + 1, d);
+  if (strspn (buf, "-0123456789") == strlen (buf))
+    strcat (buf, ".0");
+  printf ("%s", buf);
+}
+
+#endif
+
 val
 boot_write_start (val stack, val x)
 {
+#ifdef VAL_NAN
+  if (flo_p (x))
+    boot_write_flo (flo_num (x));
+  else
+#endif
   if (fixnum_p (x))
-    printf ("%d", fixnum_num (x));
+    printf ("%ld", (long)fixnum_num (x));
   else if (chr_p (x))
     {
       word c = chr_code (x);
-      printf ("#x%x", c);
+      printf ("#x%x", (unsigned)c);
+    }
+  else if (sym_p (x))
+    {
+      char *b = sym_bytes (x);
+      word n = sym_len (x);
+      for (word i = 0; i < n; i++)
+	{
+	  unsigned char c = b[i];
+	  if (strchr (boot_read_whitespace, c)
+	      || strchr (boot_read_delimiters, c)
+	      || (c == '.' && n == 1))
+	    printf ("\\%c", c);
+	  else
+	    printf ("%c", c);
+	}
     }
   else if (x == nil)
     printf ("()");
@@ -1244,22 +7213,8 @@ boot_write_start (val stack, val x)
 	    }
 	  printf ("\"");
 	}
-      else if (type == boot_symbol_type)
-	{
-	  val s = rec_ref (x, 0);
-	  val b = rec_ref (s, 0);
-	  int n = bytev_len (b);
-	  for (int i = 0; i < n; i++)
-	    {
-	      unsigned char c = bytev_ref_u8 (b, i);
-	      if (strchr (boot_read_whitespace, c)
-		  || strchr (boot_read_delimiters, c)
-		  || (c == '.' && n == 1))
-		printf ("\\%c", c);
-	      else
-		printf ("%c", c);
-	    }
-	}
+      else if (type == boot_bignum_type)
+	big_write (x);
       else
 	{
 	  printf ("{...}");
@@ -1405,23 +7360,56 @@ boot_read_to_fixnum (val tok, int n)
   if (ptr == end)
     return bool_f;
 
-  while (ptr < end && isdigit (*ptr))
+  /* Check all of it first, so that long decimals like 1234567890.5
+     are not mistaken for large integers.
+  */
+  for (char *p = ptr; p < end; p++)
+    if (!isdigit (*p))
+      return bool_f;
+
+  char *digits = ptr;
+  while (ptr < end)
     {
-      num = 10*num + (*ptr - '0');
-      if (sign*num < fixnum_min || sign*num > fixnum_max)
-	{
-	  printf ("number of out range\n");
-	  return unspec;
-	}
+      int digit = *ptr - '0';
+      if (num > (fixnum_max - digit) / 10)
+	return big_read (digits, end, sign < 0);
+      num = 10*num + digit;
       ptr++;
     }
 
-  if (ptr == end)
-    return fixnum_make (sign*num);
-  else
+  return fixnum_make (sign*num);
+}
+
+#ifdef VAL_NAN
+
+/* A token is a double when it only has digits, signs, dots, and
+   exponents, at least one digit and one dot or exponent, and when
+   strtod takes all of it.
+*/
+
+val
+boot_read_to_flo (val tok, int n)
+{
+  char buf[64], *end;
+
+  if (n >= sizeof (buf))
+    return bool_f;
+  memcpy (buf, bytev_ptr (tok, char), n);
+  buf[n] = '\0';
+
+  if (strspn (buf, "+-.0123456789eE") != n
+      || !strpbrk (buf, "0123456789")
+      || !strpbrk (buf, ".eE"))
+    return bool_f;
+
+  double d = strtod (buf, &end);
+  if (end != buf + n)
     return bool_f;
+  return flo_make (d);
 }
 
+#endif
+
 val
 boot_read_token (int first)
 {
@@ -1465,6 +7453,10 @@ boot_read_token (int first)
     }
 
   val res = boot_read_to_fixnum (tok, n);
+#ifdef VAL_NAN
+  if (res == bool_f)
+    res = boot_read_to_flo (tok, n);
+#endif
   if (res == bool_f)
     {
       if (!any_escaped
@@ -1472,12 +7464,7 @@ boot_read_token (int first)
 	  && bytev_ref_u8 (tok, 0) == '.')
 	res = boot_dot_token;
       else
-	{
-	  res = bytev_alloc (n);
-	  memcpy (bytev_ptr (res, void), bytev_ptr (tok, void), n);
-	  res = rec_make (boot_string_type, res);
-	  res = rec_make (boot_symbol_type, res);
-	}
+	res = sym_intern (bytev_ptr (tok, char), n);
     }
 
   GC_END;
@@ -1690,13 +7677,53 @@ enum {
   boot_op_set,
 
   boot_op_sum,
-  boot_op_mul
+  boot_op_mul,
+
+  boot_op_gc_stats,
+  boot_op_snapshot,
+
+  boot_op_gc,
+  boot_op_weak,
+  boot_op_table,
+  boot_op_table_ref,
+  boot_op_table_set,
+  boot_op_hash,
+  boot_op_flat,
+
+#ifdef VAL_NAN
+  boot_op_float,
+  boot_op_truncate,
+  boot_op_fsum,
+  boot_op_fsub,
+  boot_op_fmul,
+  boot_op_fdiv,
+#endif
 };
 
-struct {
-  char *sym;
+/* The names in these tables are interned when they are first looked
+   at, and are compared with 'eq' from then on.
+*/
+
+struct boot_read_name {
+  char *name;
   val v;
-} boot_read_sharps[] = {
+  val sym;
+};
+
+val
+boot_read_lookup (struct boot_read_name *names, val sym)
+{
+  for (int i = 0; names[i].name; i++)
+    {
+      if (names[i].sym == 0)
+	names[i].sym = intern (names[i].name);
+      if (names[i].sym == sym)
+	return names[i].v;
+    }
+  return unspec;
+}
+
+struct boot_read_name boot_read_sharps[] = {
   { "t", bool_t },
   { "f", bool_f },
 
@@ -1711,18 +7738,35 @@ struct {
   { "@sum",    fixnum_make (boot_op_sum) },
   { "@mul",    fixnum_make (boot_op_mul) },
 
-  NULL
+  { "@gc-stats", fixnum_make (boot_op_gc_stats) },
+  { "@snapshot", fixnum_make (boot_op_snapshot) },
+
+  { "@gc",        fixnum_make (boot_op_gc) },
+  { "@weak",      fixnum_make (boot_op_weak) },
+  { "@table",     fixnum_make (boot_op_table) },
+  { "@table-ref", fixnum_make (boot_op_table_ref) },
+  { "@table-set", fixnum_make (boot_op_table_set) },
+  { "@hash",      fixnum_make (boot_op_hash) },
+  { "@flat",      fixnum_make (boot_op_flat) },
+
+#ifdef VAL_NAN
+  { "@float",    fixnum_make (boot_op_float) },
+  { "@truncate", fixnum_make (boot_op_truncate) },
+  { "@fsum",     fixnum_make (boot_op_fsum) },
+  { "@fsub",     fixnum_make (boot_op_fsub) },
+  { "@fmul",     fixnum_make (boot_op_fmul) },
+  { "@fdiv",     fixnum_make (boot_op_fdiv) },
+#endif
+
+  { NULL }
 };
 
 val
 boot_read_sharp_symbol (val sym)
 {
-  val name = symbol_name (sym);
-  for (int i = 0; boot_read_sharps[i].sym; i++)
-    {
-      if (string_eq (name, boot_read_sharps[i].sym))
-	return boot_read_sharps[i].v;
-    }
+  val v = boot_read_lookup (boot_read_sharps, sym);
+  if (v != unspec)
+    return v;
 
   printf ("unrecognized # construct: #");
   boot_write (sym);
@@ -1730,31 +7774,22 @@ boot_read_sharp_symbol (val sym)
   return unspec;
 }
 
-struct {
-  char *sym;
-  val v;
-} boot_read_chars[] = {
+struct boot_read_name boot_read_chars[] = {
   { "space", chr_make (' ') },
   { "nl",    chr_make ('\n') },
 
-  NULL
+  { NULL }
 };
 
 val
 boot_read_char_symbol (val sym)
 {
-  val name = symbol_name (sym);
-  val bytes = rec_ref (name, 0);
-  if (bytev_len (bytes) == 1)
-    return chr_make (bytev_ptr (bytes, char)[0]);
-  else
-    {
-      for (int i = 0; boot_read_sharps[i].sym; i++)
-	{
-	  if (string_eq (name, boot_read_chars[i].sym))
-	    return boot_read_chars[i].v;
-	}
-    }
+  if (sym_len (sym) == 1)
+    return chr_make (sym_bytes (sym)[0]);
+
+  val v = boot_read_lookup (boot_read_chars, sym);
+  if (v != unspec)
+    return v;
 
   printf ("unrecognized #\\ construct: #\\");
   boot_write (sym);
@@ -1841,69 +7876,452 @@ boot_read ()
 	  return unspec;
 	}
 
-      while (stack != nil)
-	{
-	  boot_read_add (stack, x);
-	  if (boot_read_delimiter (stack) == 0)
-	    {
-	      x = boot_read_finish (stack);
-	      stack = cdr (stack);
-	    }
-	  else
-	    break;
-	}
-    }
+      while (stack != nil)
+	{
+	  boot_read_add (stack, x);
+	  if (boot_read_delimiter (stack) == 0)
+	    {
+	      x = boot_read_finish (stack);
+	      stack = cdr (stack);
+	    }
+	  else
+	    break;
+	}
+    }
+
+  GC_END;
+  return x;
+}
+
+/* Bootstrap evaluator
+
+   The bootstrap evaluator understands a simple language:
+
+   - (up . n)
+
+   A pair denotes a 'environment lookup'.  It refers to the Nth
+   element in the frame UP steps up in the chain.
+
+   - [op arg1 arg2 ...]
+
+   A vector denotes a operation.  OP is a literal integer that
+   identifies the operation.  ARG1, ARG2, etc etc are the arguments
+   for that operation.  They are either used literally or evaluated
+   recursively, depending on OP itself.
+
+   As the reader, the evaluator maintains an explicit stack to keep
+   track of nested forms.  A frame on this stack contains the form
+   that is being evaluated, a parallel vector to put the results in,
+   and a index indicating which element of the form is to be evaluated
+   next.
+
+   Since the whole state of an evaluation is in the heap, it can be
+   resumed from a snapshot.  Before [#@snapshot] starts one, the
+   evaluator pushes its current frame and puts the stack, together
+   with the environment, into 'boot_resume', which is a global root.
+   When a heap with such a state is loaded, the evaluator continues
+   from there, with [#@snapshot] returning the symbol 'resumed', and
+   only reads new input once that evaluation is done.
+*/
+
+typedef val boot_op_func (val);
+
+/* [#@sum x ...] and [#@mul x ...] add and multiply integers.  As long
+   as everything fits into small integers, they catch overflows with
+   the checked builtins of GCC and don't allocate; from the first
+   overflow or bignum on, they continue with bignums.  With doubles,
+   they compute with doubles as soon as one of the arguments is one.
+
+   Arguments of the wrong type are reported, and the operation then
+   returns #unspec.
+*/
+
+enum boot_num_kind {
+  boot_num_bad,
+  boot_num_int,
+  boot_num_flo
+};
+
+enum boot_num_kind
+boot_check_nums (val vals, int i)
+{
+  enum boot_num_kind kind = boot_num_int;
+
+  for (; i < vec_len (vals); i++)
+    {
+      val x = vec_ref (vals, i);
+      if (flo_p (x))
+	kind = boot_num_flo;
+      else if (!fixnum_p (x) && !big_p (x))
+	{
+	  printf ("wrong type argument: ");
+	  boot_write (x);
+	  printf ("\n");
+	  return boot_num_bad;
+	}
+    }
+  return kind;
+}
+
+#ifdef VAL_NAN
+val boot_op_fsum_func (val vals);
+val boot_op_fmul_func (val vals);
+#endif
+
+val
+boot_op_sum_func (val vals)
+{
+  sword x = 0, z;
+  int i;
+  for (i = 1; i < vec_len (vals); i++)
+    {
+      val y = vec_ref (vals, i);
+      if (!fixnum_p (y)
+	  || __builtin_add_overflow (x, fixnum_num (y), &z)
+	  || z < fixnum_min || z > fixnum_max)
+	break;
+      x = z;
+    }
+  if (i == vec_len (vals))
+    return fixnum_make (x);
+
+  switch (boot_check_nums (vals, i))
+    {
+    case boot_num_bad:
+      return unspec;
+#ifdef VAL_NAN
+    case boot_num_flo:
+      return boot_op_fsum_func (vals);
+#endif
+    default:
+      break;
+    }
+
+  struct big a, b;
+  big_from_sword (&a, x);
+  for (; i < vec_len (vals); i++)
+    {
+      big_from_val (&b, vec_ref (vals, i));
+      big_add (&a, &b);
+      big_free (&b);
+    }
+  return big_to_val (&a);
+}
+
+val
+boot_op_mul_func (val vals)
+{
+  sword x = 1, z;
+  int i;
+  for (i = 1; i < vec_len (vals); i++)
+    {
+      val y = vec_ref (vals, i);
+      if (!fixnum_p (y)
+	  || __builtin_mul_overflow (x, fixnum_num (y), &z)
+	  || z < fixnum_min || z > fixnum_max)
+	break;
+      x = z;
+    }
+  if (i == vec_len (vals))
+    return fixnum_make (x);
+
+  switch (boot_check_nums (vals, i))
+    {
+    case boot_num_bad:
+      return unspec;
+#ifdef VAL_NAN
+    case boot_num_flo:
+      return boot_op_fmul_func (vals);
+#endif
+    default:
+      break;
+    }
+
+  struct big a, b;
+  big_from_sword (&a, x);
+  for (; i < vec_len (vals); i++)
+    {
+      big_from_val (&b, vec_ref (vals, i));
+      big_mul (&a, &b);
+      big_free (&b);
+    }
+  return big_to_val (&a);
+}
+
+/* The statistics of the garbage collector, as a list of (name
+   . number) pairs.  Numbers that don't fit into a small integer are
+   clipped.
+*/
+
+val
+boot_stats_add (val alist, char *name, unsigned long n)
+{
+  GC_BEGIN;
+  GC_PROTECT (alist);
+
+  val x = fixnum_make (n < fixnum_max? n : fixnum_max);
+  val sym = intern (name);
+  x = cons (sym, x);
+  alist = cons (x, alist);
+
+  GC_END;
+  return alist;
+}
+
+val
+boot_op_gc_stats_func (val vals)
+{
+  struct mem_stats st = mem_stats;
+  val alist = nil;
+  char name[64];
+
+  GC_BEGIN;
+  GC_PROTECT (alist);
+
+  for (int i = mem_n_kinds-1; i >= 0; i--)
+    {
+      sprintf (name, "copied-%s-bytes", mem_kind_names[i]);
+      alist = boot_stats_add (alist, name,
+				 st.copied.words[i]*sizeof (val));
+      sprintf (name, "copied-%s-objects", mem_kind_names[i]);
+      alist = boot_stats_add (alist, name, st.copied.objects[i]);
+    }
+
+  alist = boot_stats_add (alist, "snapshot-extra-bytes", mem_snapshot_extra);
+  alist = boot_stats_add (alist, "snapshot-start-us", mem_snapshot_start_us);
+  alist = boot_stats_add (alist, "snapshots-failed", mem_snapshots_failed);
+  alist = boot_stats_add (alist, "snapshots", mem_snapshots);
+  alist = boot_stats_add (alist, "roots", mem_n_roots);
+  alist = boot_stats_add (alist, "large-bytes",
+			 mem_large_words*sizeof (val));
+  alist = boot_stats_add (alist, "used-bytes",
+			 mem_space_used (&mem_old)*sizeof (val));
+  alist = boot_stats_add (alist, "heap-bytes", mem_size*sizeof (val));
+  alist = boot_stats_add (alist, "allocated-bytes",
+			 st.allocated*sizeof (val));
+  alist = boot_stats_add (alist, "pause-max-us", mem_pause_max);
+  alist = boot_stats_add (alist, "pauses", mem_pause_count);
+  alist = boot_stats_add (alist, "incremental-steps", st.incr_steps);
+  alist = boot_stats_add (alist, "compact", st.compact);
+  alist = boot_stats_add (alist, "major", st.major);
+  alist = boot_stats_add (alist, "minor", st.minor);
+  alist = boot_stats_add (alist, "collections", st.collections);
+
+  GC_END;
+  return alist;
+}
+
+val
+boot_op_snapshot_func (val vals)
+{
+  return mem_snapshot_start ()? bool_t : bool_f;
+}
+
+/* [#@gc] makes the next allocation collect both generations.
+   [#@weak x ...] makes a weak vector of its arguments.  The others
+   work on ephemeron tables; [#@table-ref t k] returns #f when K isn't
+   in T.  [#@hash x] returns the identity hash of X.  [#@flat x ...]
+   makes a flat vector of its arguments, which must not be in the heap.
+*/
+
+val
+boot_op_gc_func (val vals)
+{
+  mem_request_full ();
+  return unspec;
+}
+
+val
+boot_op_weak_func (val vals)
+{
+  GC_BEGIN;
+  GC_PROTECT (vals);
+
+  int n = vec_len (vals) - 1;
+  val w = weak_make (n, bool_f);
+  for (int i = 0; i < n; i++)
+    vec_set (w, i, vec_ref (vals, i+1));
 
   GC_END;
-  return x;
+  return w;
 }
 
-/* Bootstrap evaluator
+val
+boot_op_table_func (val vals)
+{
+  return etab_make ();
+}
 
-   The bootstrap evaluator understands a simple language:
+val
+boot_op_table_ref_func (val vals)
+{
+  return etab_ref (vec_ref (vals, 1), vec_ref (vals, 2), bool_f);
+}
 
-   - (up . n)
+val
+boot_op_table_set_func (val vals)
+{
+  val key = vec_ref (vals, 2);
+  if (key == unspec || key == bool_f)
+    {
+      printf ("invalid table key: ");
+      boot_write (key);
+      printf ("\n");
+      return unspec;
+    }
 
-   A pair denotes a 'environment lookup'.  It refers to the Nth
-   element in the frame UP steps up in the chain.
+  etab_set (vec_ref (vals, 1), key, vec_ref (vals, 3));
+  return unspec;
+}
 
-   - [op arg1 arg2 ...]
+val
+boot_op_hash_func (val vals)
+{
+  return fixnum_make (mem_hash (vec_ref (vals, 1)));
+}
 
-   A vector denotes a operation.  OP is a literal integer that
-   identifies the operation.  ARG1, ARG2, etc etc are the arguments
-   for that operation.  They are either used literally or evaluated
-   recursively, depending on OP itself.
+val
+boot_op_flat_func (val vals)
+{
+  GC_BEGIN;
+  GC_PROTECT (vals);
 
-   As the reader, the evaluator maintains an explicit stack to keep
-   track of nested forms.  A frame on this stack contains the form
-   that is being evaluated, a parallel vector to put the results in,
-   and a index indicating which element of the form is to be evaluated
-   next.
+  int n = vec_len (vals) - 1;
+  val v = flat_make (n, fixnum_make (0));
+  for (int i = 0; i < n; i++)
+    vec_set (v, i, vec_ref (vals, i+1));
+
+  GC_END;
+  return v;
+}
+
+#ifdef VAL_NAN
+
+/* [#@float x] turns an integer into the nearest double, and
+   [#@truncate x] turns a double into an integer by rounding towards
+   zero, or returns #f for infinities and NaNs.  [#@fsum x ...],
+   [#@fmul x ...], [#@fsub x y ...], and [#@fdiv x y ...] compute with
+   doubles, and also take integers.  Subtracting or dividing a single
+   number negates or inverts it.  Since doubles are not in the heap,
+   only truncating to a bignum allocates.
 */
 
-typedef val boot_op_func (val);
+double
+boot_flo_arg (val vals, int i)
+{
+  val x = vec_ref (vals, i);
+
+  if (fixnum_p (x))
+    return fixnum_num (x);
+  else if (big_p (x))
+    {
+      struct big b;
+      big_from_val (&b, x);
+      double d = big_to_double (&b);
+      big_free (&b);
+      return d;
+    }
+  else
+    return flo_num (x);
+}
 
 val
-boot_op_sum_func (val vals)
+boot_op_float_func (val vals)
+{
+  if (boot_check_nums (vals, 1) == boot_num_bad)
+    return unspec;
+  return flo_make (boot_flo_arg (vals, 1));
+}
+
+val
+boot_op_truncate_func (val vals)
+{
+  if (boot_check_nums (vals, 1) == boot_num_bad)
+    return unspec;
+
+  double d = boot_flo_arg (vals, 1);
+  if (d - d != 0)
+    return bool_f;
+  if (d > fixnum_min - 1.0 && d < fixnum_max + 1.0)
+    return fixnum_make ((sword)d);
+  return big_from_double (d);
+}
+
+val
+boot_op_fsum_func (val vals)
 {
-  int x = 0;
+  if (boot_check_nums (vals, 1) == boot_num_bad)
+    return unspec;
+
+  double x = 0;
   for (int i = 1; i < vec_len (vals); i++)
-    x += fixnum_num (vec_ref (vals, i));
-  return fixnum_make (x);
+    x += boot_flo_arg (vals, i);
+  return flo_make (x);
 }
 
 val
-boot_op_mul_func (val vals)
+boot_op_fsub_func (val vals)
 {
-  int x = 1;
+  if (boot_check_nums (vals, 1) == boot_num_bad)
+    return unspec;
+
+  double x = boot_flo_arg (vals, 1);
+  if (vec_len (vals) == 2)
+    return flo_make (-x);
+  for (int i = 2; i < vec_len (vals); i++)
+    x -= boot_flo_arg (vals, i);
+  return flo_make (x);
+}
+
+val
+boot_op_fmul_func (val vals)
+{
+  if (boot_check_nums (vals, 1) == boot_num_bad)
+    return unspec;
+
+  double x = 1;
   for (int i = 1; i < vec_len (vals); i++)
-    x *= fixnum_num (vec_ref (vals, i));
-  return fixnum_make (x);
+    x *= boot_flo_arg (vals, i);
+  return flo_make (x);
 }
 
+val
+boot_op_fdiv_func (val vals)
+{
+  if (boot_check_nums (vals, 1) == boot_num_bad)
+    return unspec;
+
+  double x = boot_flo_arg (vals, 1);
+  if (vec_len (vals) == 2)
+    return flo_make (1 / x);
+  for (int i = 2; i < vec_len (vals); i++)
+    x /= boot_flo_arg (vals, i);
+  return flo_make (x);
+}
+
+#endif
+
 boot_op_func *boot_op_funcs[] = {
   [boot_op_sum] = boot_op_sum_func,
-  [boot_op_mul] = boot_op_mul_func
+  [boot_op_mul] = boot_op_mul_func,
+  [boot_op_gc_stats] = boot_op_gc_stats_func,
+  [boot_op_snapshot] = boot_op_snapshot_func,
+  [boot_op_gc] = boot_op_gc_func,
+  [boot_op_weak] = boot_op_weak_func,
+  [boot_op_table] = boot_op_table_func,
+  [boot_op_table_ref] = boot_op_table_ref_func,
+  [boot_op_table_set] = boot_op_table_set_func,
+  [boot_op_hash] = boot_op_hash_func,
+  [boot_op_flat] = boot_op_flat_func,
+
+#ifdef VAL_NAN
+  [boot_op_float] = boot_op_float_func,
+  [boot_op_truncate] = boot_op_truncate_func,
+  [boot_op_fsum] = boot_op_fsum_func,
+  [boot_op_fsub] = boot_op_fsub_func,
+  [boot_op_fmul] = boot_op_fmul_func,
+  [boot_op_fdiv] = boot_op_fdiv_func,
+#endif
 };
 
 val
@@ -1954,6 +8372,16 @@ boot_eval (val form)
     stack = cdr (stack);				    \
   } while (0)
 
+  if (boot_resume != nil)
+    {
+      env = car (boot_resume);
+      stack = cdr (boot_resume);
+      boot_resume = nil;
+      POP;
+      value = intern ("resumed");
+      goto use_value;
+    }
+
  eval_form:
   if (pair_p (form))
     {
@@ -2058,6 +8486,8 @@ boot_eval (val form)
 		  value = vec_ref (top_result, 2);
 		  int l = vec_len (value);
 		  val f = vec_alloc (l + 2);
+		  vec_set (f, 0, vec_ref (top_result, 0));
+		  vec_set (f, 1, vec_ref (top_result, 1));
 		  for (int i = 0; i < l; i++)
 		    vec_set (f, i+2, vec_ref (value, i));
 		  env = cons (f, env);
@@ -2065,6 +8495,19 @@ boot_eval (val form)
 		  goto eval_form;
 		}
 
+	      case boot_op_snapshot:
+		{
+		  POP;
+		  val f = vec_alloc (3);
+		  vec_set (f, 0, top_form);
+		  vec_set (f, 1, top_result);
+		  vec_set (f, 2, fixnum_make (top_pos));
+		  boot_resume = cons (env, cons (f, stack));
+		  value = boot_op_snapshot_func (nil);
+		  boot_resume = nil;
+		  goto use_value;
+		}
+
 	      default:
 		value = boot_op_funcs[top_op] (top_result);
 		POP;
@@ -2101,17 +8544,24 @@ boot_eval (val form)
 void
 debug_write (val x)
 {
-  if (val_ptr_p (x) && mem_new_first)
+  if (val_ptr_p (x) && mem_to)
     x = val_ptr_make (mem_follow_fwd_ptr (val_ptr_any_tag (x)),
 		      val_tag (x, 3));
 
+#ifdef VAL_NAN
+  if (flo_p (x))
+    boot_write_flo (flo_num (x));
+  else
+#endif
   if (fixnum_p (x))
-    printf ("%d", fixnum_num (x));
+    printf ("%ld", (long)fixnum_num (x));
   else if (chr_p (x))
     {
       word c = chr_code (x);
-      printf ("#x%x", c);
+      printf ("#x%x", (unsigned)c);
     }
+  else if (sym_p (x))
+    printf ("%.*s", (int)sym_len (x), sym_bytes (x));
   else if (x == nil)
     printf ("()");
   else if (x == bool_t)
@@ -2178,36 +8628,407 @@ pk (char *title, val x)
   return x;
 }
 
+/* Measuring the copy order
+
+   The list benchmark builds many lists at the same time, so that their
+   pairs are interleaved in memory, and then measures how fast they can
+   be traversed after a major collection has copied them.  Run it with
+   --bench-lists=CELLS, once with --gc-cdr-chain=0 for plain breadth
+   first copying, and once without, to see the difference.
+*/
+
+#define BENCH_N_LISTS  64
+#define BENCH_ROUNDS   20
+
+int bench_list_cells = 0;
+
+void
+bench_set_list_cells (char *str)
+{
+  bench_list_cells = atoi (str);
+}
+
+double
+bench_seconds ()
+{
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void
+bench_lists ()
+{
+  val lists = nil;
+
+#ifdef GC_CONSERVATIVE
+  printf ("lists: needs precise roots\n");
+  return;
+#endif
+
+  GC_BEGIN;
+  GC_PROTECT (lists);
+
+  int len = bench_list_cells / BENCH_N_LISTS;
+  lists = vec_make (BENCH_N_LISTS, nil);
+  for (int i = 0; i < len; i++)
+    for (int j = 0; j < BENCH_N_LISTS; j++)
+      {
+	val l = cons (fixnum_make (i), vec_ref (lists, j));
+	vec_set (lists, j, l);
+      }
+
+  double start = bench_seconds ();
+  if (mem_incr_active)
+    mem_incr_finish ();
+  mem_gc_major (mem_young_size);
+  double gc_time = bench_seconds () - start;
+
+  long sum = 0;
+  start = bench_seconds ();
+  for (int r = 0; r < BENCH_ROUNDS; r++)
+    for (int j = 0; j < BENCH_N_LISTS; j++)
+      for (val l = vec_ref (lists, j); l != nil; l = cdr (l))
+	sum += fixnum_num (car (l));
+  double time = bench_seconds () - start;
+
+  printf ("lists: %d cells, chain %d, gc %.3f ms, "
+	  "traversal %.1f Mcells/s (sum %ld)\n",
+	  len * BENCH_N_LISTS, mem_cdr_chain, gc_time * 1e3,
+	  (double)len * BENCH_N_LISTS * BENCH_ROUNDS / time / 1e6, sum);
+
+  GC_END;
+}
+
+/* Measuring allocation
+
+   The cons benchmark builds lists of CELLS pairs, BENCH_ROUNDS times,
+   and measures how fast the pairs are allocated.  Run it with
+   --bench-cons=CELLS, once with the normal build and once with
+   conservative roots (make suo-cons), to see what registering the
+   roots costs compared to scanning the stack.
+*/
+
+int bench_cons_cells = 0;
+
+void
+bench_set_cons_cells (char *str)
+{
+  bench_cons_cells = atoi (str);
+}
+
+void
+bench_cons ()
+{
+  val list = nil;
+
+  GC_BEGIN;
+  GC_PROTECT (list);
+
+  double start = bench_seconds ();
+  for (int r = 0; r < BENCH_ROUNDS; r++)
+    {
+      list = nil;
+      for (int i = 0; i < bench_cons_cells; i++)
+	list = cons (fixnum_make (i), list);
+    }
+  double time = bench_seconds () - start;
+
+  printf ("cons: %d cells, %s roots, %.2f Mcons/s\n",
+	  bench_cons_cells,
+#ifdef GC_CONSERVATIVE
+	  "conservative",
+#else
+	  "precise",
+#endif
+	  (double)bench_cons_cells * BENCH_ROUNDS / time / 1e6);
+
+  GC_END;
+}
+
+/* Measuring scanning
+
+   The vector benchmark fills vectors of BENCH_VECTOR_LEN fields with
+   VALUES fields in total, of which one in BENCH_VECTOR_STRIDE refers
+   to a pair and the others hold small integers, and measures how long
+   a major collection takes to copy them.  Run it with
+   --bench-vectors=VALUES, once with --gc-scan-blocks=0 to look at
+   every field on its own, and once without.
+*/
+
+#define BENCH_VECTOR_LEN    1000
+#define BENCH_VECTOR_STRIDE 16
+
+int bench_vector_values = 0;
+
+void
+bench_set_vector_values (char *str)
+{
+  bench_vector_values = atoi (str);
+}
+
+void
+bench_vectors ()
+{
+  val vecs = nil, v = nil;
+
+#ifdef GC_CONSERVATIVE
+  printf ("vectors: needs precise roots\n");
+  return;
+#endif
+
+  GC_BEGIN;
+  GC_PROTECT (vecs);
+  GC_PROTECT (v);
+
+  int n = bench_vector_values / BENCH_VECTOR_LEN;
+  for (int i = 0; i < n; i++)
+    {
+      v = vec_make (BENCH_VECTOR_LEN, fixnum_make (i));
+      for (int j = 0; j < BENCH_VECTOR_LEN; j += BENCH_VECTOR_STRIDE)
+	{
+	  val p = cons (fixnum_make (j), nil);
+	  vec_set (v, j, p);
+	}
+      vecs = cons (v, vecs);
+    }
+
+  if (mem_incr_active)
+    mem_incr_finish ();
+  mem_gc_major (mem_young_size);
+
+  double start = bench_seconds ();
+  for (int r = 0; r < BENCH_ROUNDS; r++)
+    mem_gc_major (mem_young_size);
+  double time = (bench_seconds () - start) / BENCH_ROUNDS;
+
+  printf ("vectors: %d values, blocks %s, gc %.3f ms, %.1f Mvalues/s\n",
+	  n * BENCH_VECTOR_LEN, mem_scan_blocks? "on" : "off", time * 1e3,
+	  (double)n * BENCH_VECTOR_LEN / time / 1e6);
+
+  GC_END;
+}
+
+/* Measuring parallel collection
+
+   The parallel benchmark fills the heap with about WORDS words of
+   living data, spread over BENCH_PAR_LISTS lists so that the workers
+   have something to steal from each other, and measures the pauses of
+   BENCH_PAR_ROUNDS major collections.  Each element of a list is a
+   small vector that refers to a pair.  Run it with --bench-par=WORDS
+   and --gc-threads=N for N from 1 to 8, with a --heap-max that leaves
+   room for two copies of the data, to see how the pauses scale.
+*/
+
+#define BENCH_PAR_LISTS  1024
+#define BENCH_PAR_FIELDS 8
+#define BENCH_PAR_ROUNDS 5
+
+long bench_par_words = 0;
+
+void
+bench_set_par_words (char *str)
+{
+  bench_par_words = mem_parse_size (str);
+}
+
+void
+bench_par ()
+{
+  val lists = nil, v = nil;
+
+#ifdef GC_CONSERVATIVE
+  printf ("par: needs precise roots\n");
+  return;
+#endif
+
+  GC_BEGIN;
+  GC_PROTECT (lists);
+  GC_PROTECT (v);
+
+  /* A list cell, a vector with its header, and a pair.
+   */
+  long elt_words = 2 + (BENCH_PAR_FIELDS + 2) + 2;
+  long len = bench_par_words / elt_words / BENCH_PAR_LISTS;
+  lists = vec_make (BENCH_PAR_LISTS, nil);
+  for (long i = 0; i < len; i++)
+    for (int j = 0; j < BENCH_PAR_LISTS; j++)
+      {
+	v = vec_make (BENCH_PAR_FIELDS, fixnum_make (i));
+	val p = cons (fixnum_make (j), nil);
+	vec_set (v, 0, p);
+	val l = cons (v, vec_ref (lists, j));
+	vec_set (lists, j, l);
+      }
+  v = nil;
+
+  if (mem_incr_active)
+    mem_incr_finish ();
+  mem_gc_major (mem_young_size);
+
+  double min = 0, max = 0, total = 0;
+  for (int r = 0; r < BENCH_PAR_ROUNDS; r++)
+    {
+      double start = bench_seconds ();
+      mem_gc_major (mem_young_size);
+      double time = bench_seconds () - start;
+      if (r == 0 || time < min)
+	min = time;
+      if (time > max)
+	max = time;
+      total += time;
+    }
+
+  printf ("par: %d threads, %lu MB live, pause min %.1f ms, "
+	  "average %.1f ms, max %.1f ms\n",
+	  mem_gc_threads,
+	  (unsigned long)mem_space_used (&mem_old)*sizeof (val) >> 20,
+	  min * 1e3, total / BENCH_PAR_ROUNDS * 1e3, max * 1e3);
+
+  GC_END;
+}
+
 /* Main
 
    Just for testing right now.
+
+   Options can be given on the command line, as "--name=value", or in
+   the environment.  The command line takes precedence.
  */
 
+struct {
+  char *name;
+  char *env;
+  void (*set) (char *value);
+} main_options[] = {
+  { "--heap-size", "SUO_HEAP_SIZE", mem_set_size },
+  { "--heap-max",  "SUO_HEAP_MAX",  mem_set_max_size },
+  { "--gc-threads", "SUO_GC_THREADS", mem_set_gc_threads },
+  { "--gc-pause",  "SUO_GC_PAUSE",  mem_set_pause_budget },
+  { "--gc-cdr-chain", "SUO_GC_CDR_CHAIN", mem_set_cdr_chain },
+  { "--gc-scan-blocks", "SUO_GC_SCAN_BLOCKS", mem_set_scan_blocks },
+  { "--gc-stats",  "SUO_GC_STATS",  mem_set_stats_file },
+  { "--gc-stress", "SUO_GC_STRESS", mem_set_gc_stress },
+  { "--gc-stress-seed", "SUO_GC_STRESS_SEED", mem_set_gc_stress_seed },
+  { "--image",     "SUO_IMAGE",     mem_set_image },
+  { "--boot-image", "SUO_BOOT_IMAGE", mem_set_boot_image },
+  { "--dump-image", "SUO_DUMP_IMAGE", mem_set_dump_image },
+  { "--snapshot",  "SUO_SNAPSHOT",  mem_set_snapshot },
+  { "--bench-lists", "SUO_BENCH_LISTS", bench_set_list_cells },
+  { "--bench-cons", "SUO_BENCH_CONS", bench_set_cons_cells },
+  { "--bench-vectors", "SUO_BENCH_VECTORS", bench_set_vector_values },
+  { "--bench-par", "SUO_BENCH_PAR", bench_set_par_words },
+
+  { NULL }
+};
+
+void
+main_parse_options (int arg, char **argv)
+{
+  for (int i = 0; main_options[i].name; i++)
+    {
+      char *value = getenv (main_options[i].env);
+      if (value)
+	main_options[i].set (value);
+    }
+
+  for (int j = 1; j < arg; j++)
+    {
+      int i;
+      for (i = 0; main_options[i].name; i++)
+	{
+	  int n = strlen (main_options[i].name);
+	  if (strncmp (argv[j], main_options[i].name, n) == 0
+	      && argv[j][n] == '=')
+	    {
+	      main_options[i].set (argv[j] + n + 1);
+	      break;
+	    }
+	}
+
+      if (main_options[i].name == NULL)
+	{
+	  printf ("unrecognized option: %s\n", argv[j]);
+	  exit (1);
+	}
+    }
+}
+
 int
 main (int arg, char **argv)
 {
-  val stack_item;
+#ifdef GC_CONSERVATIVE
+  mem_stack_base = __builtin_frame_address (0);
+#endif
 
+  main_parse_options (arg, argv);
+  if (mem_image_name)
+    mem_image_open ();
   mem_init ();
+  if (mem_pause_budget > 0)
+    atexit (mem_report_pauses);
+  if (mem_stats_name)
+    {
+      mem_stats_open ();
+      atexit (mem_stats_report);
+    }
   boot_init ();
 
-  val x = nil, y = nil, z = nil;
+  if (bench_list_cells > 0)
+    {
+      bench_lists ();
+      return 0;
+    }
+
+  if (bench_cons_cells > 0)
+    {
+      bench_cons ();
+      return 0;
+    }
+
+  if (bench_vector_values > 0)
+    {
+      bench_vectors ();
+      return 0;
+    }
+
+  if (bench_par_words > 0)
+    {
+      bench_par ();
+      return 0;
+    }
+
+  val x = nil;
+#ifndef GC_CONSERVATIVE
+  val y = nil, z = nil;
+#endif
 
   GC_BEGIN;
   GC_PROTECT (x);
+#ifndef GC_CONSERVATIVE
   GC_PROTECT (y);
   GC_PROTECT (z);
+#endif
 
   while (true)
     {
-      x = boot_read ();
-      if (x == unspec)
-	break;
+      if (boot_resume == nil)
+	{
+	  x = boot_read ();
+	  if (x == unspec)
+	    break;
+	}
+      else
+	x = nil;
       x = boot_eval (x);
       boot_write (x);
       printf ("\n");
     }
 
   GC_END;
+
+  mem_snapshot_poll (true);
+  if (mem_dump_image_name)
+    mem_image_dump ();
   return 0;
 }
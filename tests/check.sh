@@ -0,0 +1,87 @@
+#!/bin/sh
+
+# Run the test programs with each of the given builds of the runtime,
+# and compare what they print with the expected output in the .ref
+# files.  The lines that the collector prints are not compared.
+#
+# Each program runs with the default heap, with a heap that is small
+# enough to force compaction, and, when the build has precise roots,
+# with parallel and with incremental collection.  Images are dumped
+# and loaded back, also as boot images, and a snapshot that is taken
+# in the middle of an evaluation is resumed.
+
+dir=$(dirname "$0")
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+failed=0
+
+# check REF PROGRAM ARGS... < INPUT
+check ()
+{
+  ref=$1
+  shift
+  if ! "$@" >"$tmp/out" 2>"$tmp/err"; then
+    echo "FAIL $*"
+    tail -3 "$tmp/err"
+    failed=1
+  elif ! perl -0pe 's/GC: [^\n]*\n//g' "$tmp/out" | cmp -s - "$dir/$ref"; then
+    echo "DIFF $*"
+    failed=1
+  fi
+}
+
+# check_snapshot_failed ARGS...
+check_snapshot_failed ()
+{
+  if ! $suo "$@" <"$dir/snapshot.suo" 2>&1 \
+      | perl -0pe 's/GC: [^\n]*\n//g; s/^can.t open [^\n]*\n//mg;
+		   s/^\[#f /[#t /' \
+      | cmp -s - "$dir/snapshot.ref"; then
+    echo "DIFF $suo $*"
+    failed=1
+  fi
+}
+
+for suo in "$@"; do
+  name=$(basename "$suo")
+  img="$tmp/$name.img"
+  snap="$tmp/$name.snap"
+  echo "$name"
+
+  precise=true
+  $suo --gc-threads=2 </dev/null >/dev/null 2>&1 || precise=false
+
+  for t in gc bignum weak symbols; do
+    check $t.ref $suo <"$dir/$t.suo"
+    check $t.ref $suo --heap-size=64k --heap-max=2m <"$dir/$t.suo"
+    if $precise; then
+      check $t.ref $suo --gc-threads=3 <"$dir/$t.suo"
+      check $t.ref $suo --gc-pause=1 --heap-size=64k <"$dir/$t.suo"
+    fi
+  done
+  check weak.ref $suo --gc-stress=1 <"$dir/weak.suo"
+  check weak.ref $suo --gc-stress=3 --gc-stress-seed=7 <"$dir/weak.suo"
+
+  if [ "$(echo '[#@float 1]' | $suo)" = "1.0" ]; then
+    check float.ref $suo <"$dir/float.suo"
+    check float.ref $suo --gc-stress=1 <"$dir/float.suo"
+  fi
+
+  check symbols.ref $suo --dump-image="$img" <"$dir/symbols.suo"
+  check symbols.ref $suo --image="$img" <"$dir/symbols.suo"
+  check gc.ref $suo --image="$img" --heap-max=3m <"$dir/gc.suo"
+  check gc.ref $suo --boot-image="$img" <"$dir/gc.suo"
+  check weak.ref $suo --boot-image="$img" --heap-size=64k <"$dir/weak.suo"
+
+  check snapshot.ref $suo --snapshot="$snap" <"$dir/snapshot.suo"
+
+  # A snapshot that can't be written, or that can't be taken because
+  # the boot image is mapped, must not disturb the program.  Only
+  # whether it was started and the message of the failing child
+  # differ from a working one.
+  check_snapshot_failed --snapshot="$tmp/none/snap"
+  check_snapshot_failed --boot-image="$img" --snapshot="$snap"
+  check resume.ref $suo --image="$snap" <"$dir/resume.suo"
+done
+
+exit $failed